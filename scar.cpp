@@ -2,20 +2,41 @@
 //
 // DNA inspred slack space searcher.
 //
-// Usage: ./searcher
+// Usage: ./scar [serve | query | coordinate]
 //        -d <device>               The name of the device to examine.
 //        -p <pattern_dir>          The directory with the patterns (files) to look for.
 //        -t <threads>              Number of threads to start on this machine.
 //        -c <disk_chunk_size>      Read this many bytes at a time from the device.
 //        -f <file_chunk_size>      Read this many bytes at a time from the patterns.
+//        -s <socket>               Unix socket for "serve" and "query".
+//        -o <file>                 Write the results here instead of stdout.
+//        --forget / --shutdown     Have "query" tell the server to drop its cache / stop.
+//        --shard <i>/<N>           Only search piece i (from 0) of N of the device.
+//        -n <workers>              How many shards "coordinate" runs.
+//        --hosts <h1,h2,...>       Run the "coordinate" shards on these over ssh.
+//        --remote <scar>           The scar program on those hosts.
+//        --numa                    Pin threads and keep their buffers on their own node.
+//        --cpu-offset <n>          With --numa, start at the n'th CPU (coordinate sets this).
+//        --hugepages               Put the disk chunk buffers on 2M pages.
+//        --tune                    Time some probes and pick -t / -c / -f for us.
+//        --profile <file>          Save what --tune picked, or use what it saved.
 //        -l                        Increases the log level (debugging) by 1 per use.
 //
+//        ./scar merge [-o <file>] <partial> ...
+//
+// With no mode word this does one search and exits. "serve" sits on
+// the socket keeping images and pattern directories loaded between
+// requests, and "query" asks it to do a search (see scar_serve.cpp).
+// "merge" and "coordinate" put --shard runs back together (see
+// scar_shard.cpp).
+//
 // Implementation: Bill Mahoney
 // For:            General purpose experimentation!
 // Note:           This will not work (and possibly even segfault) if:
 //                 -- <file_chunk_size> (the size of the pattern) is < the size of a machine word
 //                 -- <file_chunk_size> (the size of the pattern) is > <disk_chunk_size>
 //                 -- the size of the text is < the size of the machine word
+//                 so setup refuses those.
 //
 // Couple other notes. How to know the block size of a drive?
 //     blockdev --getbsz /dev/sdb
@@ -25,423 +46,229 @@
 // necessary to do everything with the understanding that a filesystem
 // has a minimum block size of 512. So a "block" is 512 in all cases.
 //
+// The search itself lives in scar_engine.cpp (libscar.a).
+//
 // ============================================================
 
+#include "scar.h"
 #include <iostream>
+#include <fstream>
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <stdarg.h>
-#include <pthread.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <ctype.h>
-
-#define POSIX_THREADS 1 // Use threads?
 
 using namespace std;
 
-typedef unsigned long PATTERN_WORD; // On Ubuntu this is 8 bytes
-const unsigned int SEC_SIZE = 512;  // Works better than 4K
-
-// Note that some of these are global variables but they are set only
-// once based on the command line, so I left them here.
-off64_t disk_chunk = 1048576;             // Read this many from the device
-off64_t disk_loops = 0;                   // How many disk_chunk's worth are in the image?
-off64_t file_chunk = 65536;               // One chunk's worth out of the file we're looking for
-unsigned int threads = 8;                 // How many do you want to run?
-unsigned int log_level = 0;               // How much information do you want to see?
-char *patterns = (char *) "./patterns";   // Default pattern directory
-char *device = (char *) "/data/bill_disk_images/FAT1G";
-
-enum status_e {
-	       available = 1,
-	       needs_data, 
-	       needs_cpu,
-	       completed
-};
-
-const char *status_e[] = {
-			  "oops",
-			  "available",
-			  "needs_data", 
-			  "needs_cpu",
-			  "completed"
-};
-
-// The structure that goes back and forth to the threads
-struct search_s {
-    enum status_e status;            // What is this one up to now?
-    int           fd;                // File descriptor for this file
-    char          *filename;         // Will be strdup'd so free it
-    unsigned char *disk;             // Points at a chunk of the disk
-    unsigned char *buf;              // Points at a chunk of the file
-    unsigned char *match;            // The score array for this file (bytes)
-    unsigned int  sector_read_count; // How many did we get on the last read?
-    unsigned int  current_sector;    // Where are we in the file?
-    unsigned int  total_sectors;     // How many sectors total?
-    unsigned int  scans;             // How many scans (disk chunks) so far?
-    unsigned int  me;                // So that the threads know what to log
-    pthread_t     tid;               // From pthread_create
-};
-
-bool setup( int ac, char *av[] );
-char *next_file( const char *directory );
-unsigned int papm_rl( const unsigned char *t, unsigned int n, const unsigned char *p, unsigned int m );
-void *scan_disk_blocks( void *params );
-void log( unsigned int, const char * format, ... );
-void dump_sector( unsigned char *sec );
+bool setup( int ac, char *av[], scar_options &opt );
+void print_to_stream( const scar_result &result, void *context );
 
 // ============================================================
 //
 // Start here - let's go!
 //
-// It would be much better to split thos whole "main" into parts but
-// the whole thing grew larger a wee bit at a time and I just never
-// got to it.
-//
 // ============================================================
 
 int main( int ac, char *av[] )
 {
+    scar_options opt;
 
     if ( sizeof( PATTERN_WORD ) != 8 )
     {
         cerr << "Compile / typedef mistake...\n";
         return( 1 );
     }
-    
-    if ( ! setup( ac, av ) )
-	return( 1 );
-
-    // ============================================================
-    // OK let's do the easy thing first and make sure we can open the
-    // device, since you might need to be "sudo" to do it.
-    // ============================================================
 
-    int disk_fd = open( device, O_RDONLY );
-    if ( disk_fd < 0 )
-    {
-        cerr << "Error opening the device " << av[ 1 ] << ".\n";
-        if ( geteuid() != 0 )
-            cerr << "Maybe you need to be sudo'd? Or does it not exist?\n";
-        perror( "open" );
-        exit( 2 );
-    }
+    if ( ! setup( ac, av, opt ) )
+	return( 1 );
 
-    // ============================================================
-    // We need to make sure that the buffer for the disk image does
-    // not leave any fractional reads or we may get false positives on
-    // the slack space. Do this after any user-defined buffer size.
-    // ============================================================
+    if ( opt.mode == serve_mode )
+        return( serve( opt ) );
 
-    off64_t actual_image_size = lseek64( disk_fd, (off64_t) 0, SEEK_END );
-    if ( actual_image_size < disk_chunk )
-    {
-        log( 0, "Adjusting disk_chunk setting down to actual size of %llu\n", actual_image_size );
-        disk_chunk = actual_image_size;
-        disk_loops = 1;
-    }
-    else
+    ofstream output_file;
+    ostream *out = &cout;
+    if ( opt.output )
     {
-        if ( actual_image_size % disk_chunk != 0 )
-        {
-            // This is a problem. For now just punt.
-            cerr << "The actual image size in bytes is not divisible by " << disk_chunk << "\n";
-            close( disk_fd );
-            exit( 3 );
-        }
-        else
+        output_file.open( opt.output );
+        if ( ! output_file )
         {
-            log( 1, "The setting for disk_chunk looks good - %llu\n", disk_chunk );
-            disk_loops = actual_image_size / disk_chunk;
+            perror( opt.output );
+            exit( 2 );
         }
+        out = &output_file;
     }
 
-    // ============================================================
-    // Set up structures and such... The pointer to the disk buffer
-    // and file buffer in the search set are set up once and left.
-    // ============================================================
-
-    unsigned int  which_disk_buffer = 0;
-    unsigned char *disk_buffer[ 2 ];
-    disk_buffer[ 0 ] = (unsigned char *) malloc( disk_chunk );
-    disk_buffer[ 1 ] = (unsigned char *) malloc( disk_chunk );
-    search_s *search_set = (search_s *) malloc( sizeof( search_s ) * threads );
-    if ( ( ! disk_buffer[ 0 ] ) ||
-         ( ! disk_buffer[ 1 ] ) ||
-         ( ! search_set       ) )
-    {
-        cerr << "malloc failed!?" << endl;
-        exit( 1 );
-    }
+    if ( opt.mode == query_mode )
+        return( query( opt, *out ) );
 
-    for( unsigned int i = 0; i < threads; i++ )
+    // Anything given with -t / -c / -f stays as given.
+    if ( opt.tune )
     {
-	search_set[ i ].status = available;
-        search_set[ i ].disk = disk_buffer[ which_disk_buffer ]; // initially 0
-        search_set[ i ].buf = (unsigned char *) malloc( file_chunk );
-        search_set[ i ].me = i;
+        scar_tuning tuning;
+        tuning.threads = opt.threads;
+        tuning.disk_chunk = opt.disk_chunk;
+        tuning.file_chunk = opt.file_chunk;
+        if ( ! tune( opt.device, opt.patterns, tuning, opt.given,
+                     opt.mode == coordinate_mode ? opt.workers : 1 ) )
+            exit( 2 );
+        opt.threads = tuning.threads;
+        opt.disk_chunk = tuning.disk_chunk;
+        opt.file_chunk = tuning.file_chunk;
+        if ( opt.profile && ! save_profile( opt.profile, tuning ) )
+            exit( 2 );
     }
-    
-    // ============================================================
-    // OK here we go
-    // ============================================================
 
-    log( 1, "Starting up...\n" );
+    if ( opt.mode == merge_mode )
+        return( merge( opt, *out ) );
+    if ( opt.mode == coordinate_mode )
+        return( coordinate( opt, *out ) );
 
-    off64_t alive = 0;
-    bool more_files_to_do = true;
-    bool keep_going = true;
-    while ( keep_going )
-    {
-        log( 1, "In the main loop...\n" );
+    ScanEngine engine( opt.disk_chunk, opt.file_chunk, opt.threads, opt.flags, opt.cpu_offset );
+    if ( ! engine.ok() )
+        exit( 2 );
 
-        // See notes above - the setting for disk_chunk must be an
-        // even divisor of the size of the filesystem image.
-        lseek64( disk_fd, (off64_t) 0, SEEK_SET );
+    int image = engine.attach_image( opt.device );
+    if ( image < 0 )
+        exit( 2 );
 
-        // I was originally just calling read at the top of the loop,
-        // and considered switching to aio_read while the threds were
-        // running. But the thread execution time seems longer than
-        // the I/O delay so I have not done aio yet.
+    int pattern_set = engine.load_patterns( opt.patterns );
+    if ( pattern_set < 0 )
+        exit( 2 );
 
-        ssize_t read_count = read( disk_fd, disk_buffer[ 0 ], disk_chunk );
-        
-        while ( keep_going && read_count == disk_chunk )
-        {
-            log( 2, "Still working... Disk chunk %u\n", alive++ );
-            if ( alive == disk_loops ) alive = 0;
-
-            // ============================================================
-            // First, see if anybody is now finished. If so, print the
-            // stats and clean up the slot so that it can be
-            // reused. Do this first so that we can fill all available
-            // slots if we have any.
-            // ============================================================
-            
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == completed )
-                {
-                    unsigned total = 0;
-                    for( unsigned int rep = 0; rep < search_set[ i ].total_sectors; rep++ )
-                        total += (unsigned) search_set[ i ].match[ rep ];
-                    total /= search_set[ i ].total_sectors;
-                    cout << search_set[ i ].filename << ": sectors = "
-                         << search_set[ i ].total_sectors << " score = ";
-                    if ( total == 10 )
-                        cout << "*";
-                    else
-                        cout << total;
-                    cout << " by sector = ";
-                    for( unsigned int rep = 0; rep < search_set[ i ].total_sectors; rep++ )
-                    {
-                        char ch = '*';
-                        if ( search_set[ i ].match[ rep ] < 10 )
-                            ch = search_set[ i ].match[ rep ] + '0';
-                        cout << ch;
-                    }
-                    cout << endl;
-                    close( search_set[ i ].fd );
-                    search_set[ i ].fd = -1;
-                    free( search_set[ i ].filename );
-                    free( search_set[ i ].match );
-                    search_set[ i ].status = available;
-                }
-
-            // ============================================================
-            // Next look for available "slots" to assign work to.
-            // ============================================================
-
-            for( unsigned int i = 0; i < threads && more_files_to_do; i++ )
-                // Is this slot looking for work?
-                if ( search_set[ i ].status == available )
-                {
-                    char *filename = next_file( patterns );
-                    if ( filename )
-                    {
-                        search_set[ i ].fd = open( filename, O_RDONLY );
-                        // If the open is OK we'll use this thread
-                        if ( search_set[ i ].fd >= 0 )
-                        {
-                            log( 2, "search_set[ %d ].filename = %s\n", i, filename );
-                            // We want to make this LESS than the actual total number of sectors because
-                            // the last sector of the file will be partially filled anyhow so not 100% match.
-                            search_set[ i ].total_sectors = lseek64( search_set[ i ].fd, 0, SEEK_END ) / SEC_SIZE;
-                            lseek64( search_set[ i ].fd, 0, SEEK_SET );
-                            search_set[ i ].current_sector = 0;
-                            search_set[ i ].filename = strdup( filename );
-                            search_set[ i ].match = (unsigned char *) calloc( search_set[ i ].total_sectors, 1 );
-                            search_set[ i ].status = needs_data;
-                            search_set[ i ].sector_read_count = 0;
-                            search_set[ i ].scans = 0;
-                        }
-                        else
-                            // The handling here is not quite right - we ought to try
-                            // the next file but in the same slot. Oh well.
-                            perror( filename );
-                    }
-                    else
-                    {
-                        // There's no more pattern files.
-                        more_files_to_do = false;
-                        break;
-                    }
-                }
-
-            // ============================================================
-            // Next, load data for any slot that needs it.
-            // ============================================================
-
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_data )
-                {
-                    // Like above, don't round the sectors up, truncate the count down. 
-                    search_set[ i ].sector_read_count = read( search_set[ i ].fd, search_set[ i ].buf, file_chunk ) / SEC_SIZE;
-                    // If there's not a sector's worth left then don't schedule it.
-                    // On the other hand, if there IS data we need some CPU time now.
-                    search_set[ i ].status = ( search_set[ i ].sector_read_count > 0 ) ? needs_cpu : completed;
-                    log( 2, "search_set[ %d ].sector_read_count = %d and status = %s\n", i,
-                         search_set[ i ].sector_read_count, status_e[ search_set[ i ].status ] );
-                }
-
-            // ============================================================
-            // Do the actual scan of this chunk of image with this set of files.
-	    // This log is in honor of my 9th grade algebra teacher, Mr. Willard.
-	    // He always said this right at the beginning of every class.
-            // ============================================================
-            
-            log( 2, "Talking stopped. Work. To. Be. Done!\n" );
-
-            #if POSIX_THREADS
-            // Start them all in parallel
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_cpu )
-                    pthread_create( &search_set[ i ].tid, NULL,
-                                    scan_disk_blocks, (void *) &search_set[ i ] );
-            // Let's do the I/O while we wait.
-            which_disk_buffer = ( which_disk_buffer == 0 ) ? 1 : 0;
-            read_count = read( disk_fd, disk_buffer[ which_disk_buffer ], disk_chunk );
-            // Then wait for all to finish
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_cpu )
-                {
-                    pthread_join( search_set[ i ].tid, NULL );
-                    search_set[ i ].scans++;
-                }
-            #else
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_cpu )
-                {
-                    scan_disk_blocks( (void *) &search_set[ i ] );
-                    search_set[ i ].scans++;
-                }
-            which_disk_buffer = ( which_disk_buffer == 0 ) ? 1 : 0;
-            read_count = read( disk_fd, disk_buffer[ which_disk_buffer ], disk_chunk );
-            #endif
-
-            // Switch everyone over to use the new disk buffer.
-            for( unsigned int i = 0; i < threads; i++ )
-                search_set[ i ].disk = disk_buffer[ which_disk_buffer ];
-            
-            log( 2, "One disk scan completed...\n" );
-
-            // ============================================================
-            // Slight optimization heuristic. If we have any sets
-            // where all the matches are 100% we may as well mark it
-            // as completed and free up the slot for somebody else.
-            // ============================================================
-
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_cpu )
-                {
-                    search_set[ i ].status = completed;
-                    for( unsigned int m = 0; m < search_set[ i ].total_sectors; m++ )
-                        if ( search_set[ i ].match[ m ] < 10 )
-                        {
-                            search_set[ i ].status = needs_cpu;
-                            break;
-                        }
-                }
-
-            // ============================================================
-            // See if somebody needs more data. They need data if they
-            // have completed an entire disk scan.
-            // ============================================================
-            
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status == needs_cpu )
-                {
-                    if ( search_set[ i ].scans == disk_loops )
-                    {
-                        search_set[ i ].scans = 0; // Do the disk again
-                        search_set[ i ].status = needs_data;
-                        search_set[ i ].current_sector += search_set[ i ].sector_read_count;
-                    }
-                }
-
-            // ============================================================
-            // Finally, if we get to the end of a disk chunk scan and
-            // every slot is available then we must have finished all
-            // the files.
-            // ============================================================
-            
-            keep_going = false;
-            for( unsigned int i = 0; i < threads; i++ )
-                if ( search_set[ i ].status != available )
-                {
-                    keep_going = true;
-                    break;
-                }
-
-            // ============================================================
-            // Debugging - print the status
-            // ============================================================
-            
-            log( 2, "search_set[].status = " );
-            for( unsigned int i = 0; i < threads; i ++ )
-                log( 2, "%s ", status_e[ search_set[ i ].status ] );
-            log( 2, "\n" );
-        }
-    }
+    // Say which piece this is so that "merge" can tell if any are
+    // missing.
+    if ( opt.shards > 1 )
+        *out << "scar shard " << opt.shard << "/" << opt.shards << endl;
+
+    if ( ! engine.run( image, pattern_set, print_to_stream, out, opt.shard, opt.shards ) )
+        return( 1 );
+
+    // And say that it got all the way through, since a shard that died
+    // part way leaves a file that looks fine but is missing patterns.
+    if ( opt.shards > 1 )
+        *out << "scar shard " << opt.shard << "/" << opt.shards << " done" << endl;
     return( 0 );
 }
 
+// ============================================================
+//
+// print_to_stream
+//
+// Result callback for the engine - context is the ostream.
+//
+// ============================================================
+
+void print_to_stream( const scar_result &result, void *context )
+{
+    print_result( *(ostream *) context, result );
+}
+
 // ============================================================
 //
 // setup
 //
-// Here we will process through the command line arg's and set various
-// global values for this run of the tool.
+// Here we will process through the command line arg's and fill in the
+// options for this run of the tool.
 //
 // ============================================================
 
-bool setup( int ac, char *av[] )
+bool setup( int ac, char *av[], scar_options &opt )
 {
     unsigned long temp;
     bool          ok = true;
-    
+
+    opt.mode = scan_mode;
+    opt.device = NULL;
+    opt.patterns = NULL;
+    opt.socket = "/tmp/scar.sock";
+    opt.output = NULL;
+    opt.request = "scan";
+    opt.disk_chunk = 1048576;
+    opt.file_chunk = 65536;
+    opt.threads = 8;
+    opt.flags = 0;
+    opt.given = 0;
+    opt.tune = false;
+    opt.profile = NULL;
+    opt.shard = 0;
+    opt.shards = 1;
+    opt.cpu_offset = 0;
+    opt.workers = 0;
+    opt.hosts = NULL;
+    opt.remote = "scar";
+
     for( int i = 1; i < ac; i++ )
 	if ( av[ i ][ 0 ] == '-' )
 	    switch( av[ i ][ 1 ] )
 	    {
 	        case 'd': // Device
 		    if ( av[ i ][ 2 ] )
-			device = &av[ i ][ 2 ];
+			opt.device = &av[ i ][ 2 ];
 		    else
-			device = av[ ++i ];
+			opt.device = av[ ++i ];
 		    break;
 
 	        case 'p': // Pattern directory
 		    if ( av[ i ][ 2 ] )
-			patterns = &av[ i ][ 2 ];
+			opt.patterns = &av[ i ][ 2 ];
+		    else
+			opt.patterns = av[ ++i ];
+		    break;
+
+	        case 's': // Socket
+		    if ( av[ i ][ 2 ] )
+			opt.socket = &av[ i ][ 2 ];
 		    else
-			patterns = av[ ++i ];
+			opt.socket = av[ ++i ];
+		    break;
+
+	        case 'o': // Output file
+		    if ( av[ i ][ 2 ] )
+			opt.output = &av[ i ][ 2 ];
+		    else
+			opt.output = av[ ++i ];
+		    break;
+
+	        case 'n': // Workers
+		    if ( av[ i ][ 2 ] )
+			temp = strtoul( (const char *) &av[ i ][ 2 ], NULL, 0 );
+		    else
+			temp = strtoul( (const char *) av[ ++i ], NULL, 0 );
+		    opt.workers = (unsigned int) temp;
+		    break;
+
+	        case '-': // Long options
+		    if ( strcmp( av[ i ], "--numa" ) == 0 )
+			opt.flags |= SCAR_NUMA;
+		    else if ( strcmp( av[ i ], "--hugepages" ) == 0 )
+			opt.flags |= SCAR_HUGEPAGES;
+		    else if ( strcmp( av[ i ], "--tune" ) == 0 )
+			opt.tune = true;
+		    else if ( strcmp( av[ i ], "--forget" ) == 0 )
+			opt.request = "forget";
+		    else if ( strcmp( av[ i ], "--shutdown" ) == 0 )
+			opt.request = "shutdown";
+		    // The rest all take a value
+		    else if ( i + 1 >= ac )
+			ok = false;
+		    else if ( strcmp( av[ i ], "--shard" ) == 0 )
+		    {
+			if ( sscanf( av[ ++i ], "%u/%u", &opt.shard, &opt.shards ) != 2 ||
+			     opt.shards == 0 || opt.shard >= opt.shards )
+			{
+			    cerr << "--shard wants <i>/<N> with i from 0 to N - 1." << endl;
+			    ok = false;
+			}
+		    }
+		    else if ( strcmp( av[ i ], "--cpu-offset" ) == 0 )
+			opt.cpu_offset = (unsigned int) strtoul( av[ ++i ], NULL, 0 );
+		    else if ( strcmp( av[ i ], "--hosts" ) == 0 )
+			opt.hosts = av[ ++i ];
+		    else if ( strcmp( av[ i ], "--remote" ) == 0 )
+			opt.remote = av[ ++i ];
+		    else if ( strcmp( av[ i ], "--profile" ) == 0 )
+			opt.profile = av[ ++i ];
+		    else
+			ok = false;
 		    break;
 
 	        case 't': // Threads
@@ -449,7 +276,8 @@ bool setup( int ac, char *av[] )
 			temp = strtoul( (const char *) &av[ i ][ 2 ], NULL, 0 );
 		    else
 			temp = strtoul( (const char *) av[ ++i ], NULL, 0 );
-		    threads = (unsigned int) temp;
+		    opt.threads = (unsigned int) temp;
+		    opt.given |= TUNE_THREADS;
 		    break;
 
 	        case 'c': // disk chunk
@@ -457,7 +285,8 @@ bool setup( int ac, char *av[] )
 			temp = strtoul( (const char *) &av[ i ][ 2 ], NULL, 0 );
 		    else
 			temp = strtoul( (const char *) av[ ++i ], NULL, 0 );
-		    disk_chunk = (unsigned int) temp;
+		    opt.disk_chunk = (unsigned int) temp;
+		    opt.given |= TUNE_DISK_CHUNK;
 		    break;
 
 	        case 'f': // file chunk
@@ -465,281 +294,165 @@ bool setup( int ac, char *av[] )
 			temp = strtoul( (const char *) &av[ i ][ 2 ], NULL, 0 );
 		    else
 			temp = strtoul( (const char *) av[ ++i ], NULL, 0 );
-		    file_chunk = (unsigned int) temp;
+		    opt.file_chunk = (unsigned int) temp;
+		    opt.given |= TUNE_FILE_CHUNK;
 		    break;
 
                 case 'l': // log level
                     log_level++;
                     break;
 	    }
+	else if ( i == 1 && strcmp( av[ i ], "serve" ) == 0 )
+	    opt.mode = serve_mode;
+	else if ( i == 1 && strcmp( av[ i ], "query" ) == 0 )
+	    opt.mode = query_mode;
+	else if ( i == 1 && strcmp( av[ i ], "merge" ) == 0 )
+	    opt.mode = merge_mode;
+	else if ( i == 1 && strcmp( av[ i ], "coordinate" ) == 0 )
+	    opt.mode = coordinate_mode;
+	else if ( opt.mode == merge_mode )
+	    opt.files.push_back( av[ i ] );
 	else
 	    // Something on command line that's not an option
 	    ok = false;
-    
-    if ( disk_chunk % SEC_SIZE )
+
+    // The daemon only loads things up front if it was told to, so
+    // leave those alone for it.
+    if ( opt.mode != serve_mode )
     {
-	cerr << "The disk chunk size must be a multiple of " << SEC_SIZE << "." << endl
-	     << "Might I suggest 1048576 a.k.a. 0x100000?" << endl;
-	ok = false;
+        if ( ! opt.device )
+            opt.device = "/data/bill_disk_images/FAT1G";
+        if ( ! opt.patterns )
+            opt.patterns = "./patterns";
     }
-    
-    if ( file_chunk % SEC_SIZE )
+
+    if ( opt.mode == merge_mode && opt.files.empty() )
     {
-	cerr << "The file/pattern chunk size must be a multiple of " << SEC_SIZE << "." << endl
-	     << "Might I suggest 65536 a.k.a. 0x10000?" << endl;
+	cerr << "Nothing to merge." << endl;
 	ok = false;
     }
 
-    if ( ! ok )
+    if ( opt.mode == coordinate_mode && ! opt.workers && ! opt.hosts )
     {
-        cerr << "Usage: " << av[ 0 ]
-	     << ": [-d <device>] [-p <patterndir>] [-t <threads>] [-c <diskchunk>] [-f <filechunk>]" << endl
-	     << "       <device> has the file system" << endl
-             << "       <patterndir> is a directory with file patterns" << endl
-	     << "       <threads> is the numbe rof threads to start" << endl
-	     << "       <diskchunk> is the size of the chunk to read from the drive, multiple of " << SEC_SIZE << endl
-	     << "       <filechunk> is the size of the chunk to read for each pattern, multiple of " << SEC_SIZE << endl
-	     << "       Defaults: -d" << device << " -p" << patterns << " -t" << threads << " -c" << disk_chunk << " -f" << file_chunk
-	     << endl;
-        exit( 1 );
+	cerr << "Need -n <workers> and/or --hosts to know how many shards to run." << endl;
+	ok = false;
     }
 
-    return( ok );
-}
-
-// ============================================================
-//
-// next_file
-//
-// The first time this is called it sets up to search the indicated
-// directory. The first and subsequent calls give the next filename
-// from the directory. Note that the filename is set up in a local
-// static char array. It will be overwritten on subsequent calls to
-// the function. The function will return NULL insteda of the pointer
-// when there's no more files.
-// 
-// ============================================================
-
-char *next_file( const char* directory )
-{
-
-    static DIR *dir;
-    static char filename[ 1024 ];
-    static unsigned int av2_len;
-    static struct dirent *nextfile;
-    static bool no_more = false;
-    char *ret = NULL;
-
-    // Dirty fix. Doing a "closedir" more than once causes a double
-    // free.
-    if ( no_more )
-        return( NULL );
-    
-    // Happens on the first call.
-    if ( ! dir )
+    if ( opt.output && opt.mode == serve_mode )
     {
-        dir = opendir( directory );
-        if ( ! dir )
-        {
-            cerr << "Error opening the directory " << directory << ".\n";
-            perror( "opendir" );
-            exit( 2 );
-        }
-        av2_len = strlen( directory );
+	cerr << "serve sends its results to whoever asked, so -o doesn't go with it." << endl;
+	ok = false;
     }
-    
-    nextfile = readdir( dir );
-    errno = 0; // The global one in <errno.h>
-    while ( nextfile )
-        if ( nextfile -> d_name[ 0 ] != '.' )
-        {
-            // Multiple Linux disclaimers about MAX_PATH can be found...
-            // Just print a note and try the next filename. 
-            if ( av2_len + strlen( nextfile -> d_name ) + 2 >= 1024 )
-                cerr << "Filename too long: " << nextfile -> d_name << endl;
-            else
-            {
-                strcpy( filename, directory );
-                if ( filename[ av2_len - 1 ] != '/' )
-                    strcpy( &filename[ av2_len ], "/" );
-                strcat( filename, nextfile -> d_name );
-		ret = filename;
-                // Get out and return it
-                break;
-            }
-        }
-	else
-            // Otherwise try the next one
-            nextfile = readdir( dir );
 
-    // If we come out with nextfile null we're either done or an error.
-    if ( ! nextfile )
+    if ( strcmp( opt.request, "scan" ) != 0 && opt.mode != query_mode )
     {
-        if ( errno != 0 )
-        {
-            cerr << "Error reading the pattern directory " << directory << ".\n";
-            perror( "readdir" );
-        }
-        closedir( dir );
-        no_more = true;
+	cerr << "--forget and --shutdown are for query." << endl;
+	ok = false;
     }
 
-    return( ret );
-}
-
-// ============================================================
-// Processor Aware Pattern Matching - right to left
-//
-// t is the text of size n
-// p is the pattern of size m
-//
-// In this algorithm we are not even bothering to attempt any match
-// other than one at the "back end" of t. For our uses this is the
-// only one we are looking at so there's no need to track the
-// "windows" like in the full algorithm from the paper.
-//
-// One modification is that if the entire block is made up of zeros we
-// return 0 to indicate "NO" match at all.
-// ============================================================
-
-unsigned int papm_rl( const unsigned char *t, unsigned int n, const unsigned char *p, unsigned int m )
-{
-
-    unsigned int in_text = n - sizeof( PATTERN_WORD );
-    unsigned int in_pattern = m - sizeof( PATTERN_WORD );
-    unsigned int match_count = 0;
-    bool all_zero = true;
-    
-    while ( *( (PATTERN_WORD *) &p[ in_pattern ] ) == *( (PATTERN_WORD *) &t[ in_text ] ) )
+    if ( opt.tune && opt.mode != scan_mode && opt.mode != coordinate_mode )
     {
-        match_count += sizeof( PATTERN_WORD );
-
-        // If it's not zero we'll remember this fact.
-        if ( *( (PATTERN_WORD *) &p[ in_pattern ] ) )
-            all_zero = false;
-        
-        // Tail end of a word not divisible by the word size?  This is
-	// the case when "in_pattern" becomes zero. We do want to
-	// check the very last (first) word of the pattern so if we
-	// did and now that was element zero then we are done.
-        if ( in_pattern < sizeof( PATTERN_WORD ) )
-            break;
-        else
-        {
-            in_pattern -= sizeof( PATTERN_WORD );
-            in_text -= sizeof( PATTERN_WORD );
-        }
+	cerr << "--tune goes with a search or coordinate, not serve / query / merge." << endl;
+	ok = false;
     }
 
-    // Again, this "should not happen" if we are complete blocks.
-    if ( in_pattern < sizeof( PATTERN_WORD ) )
-        // At most sizeof( PATTERN_WORD ) - 1 iterations.
-        while ( in_pattern != 0 )
-        {
-            --in_pattern; --in_text;
-            if ( p[ in_pattern ] == t[ in_text ] )
-                match_count++;
-            if ( p[ in_pattern ] )
-                all_zero = false;
-        }
-    
-    return( all_zero ? 0 : match_count );
-}
-
-// ============================================================
-//
-// scan_disk_blocks
-//
-// Note that the function technically returns a pointer only so that
-// the prototype / signature matches pthread_create.
-//
-// ============================================================
-
-void *scan_disk_blocks( void *param )
-{
-    search_s *data = (search_s *) param;
+    // The probes time this machine, which says nothing about the
+    // hosts, and the device may not even be here.
+    if ( opt.tune && opt.hosts )
+    {
+	cerr << "--tune can't go with --hosts; run --tune --profile on one of the hosts and copy the profile." << endl;
+	ok = false;
+    }
 
-    // This "should not happen"
-    if ( data -> sector_read_count == 0 )
+    // A saved profile fills in whatever wasn't on the command line.
+    if ( ok && opt.profile && ! opt.tune )
     {
-	log( 0, "scan_disk_blocks for thread %u has no sectors? sector_read_count = %u?\n",
-	     data -> me, data -> sector_read_count );
-        data -> status = completed;
+	scar_tuning tuning;
+	tuning.threads = opt.threads;
+	tuning.disk_chunk = opt.disk_chunk;
+	tuning.file_chunk = opt.file_chunk;
+	if ( load_profile( opt.profile, opt.device, tuning, opt.given ) )
+	{
+	    if ( ! ( opt.given & TUNE_THREADS ) )
+		opt.threads = tuning.threads;
+	    if ( ! ( opt.given & TUNE_DISK_CHUNK ) )
+		opt.disk_chunk = tuning.disk_chunk;
+	    if ( ! ( opt.given & TUNE_FILE_CHUNK ) )
+		opt.file_chunk = tuning.file_chunk;
+	}
+	else
+	    ok = false;
     }
 
-    // Which spot will this map to in the "match" array?
-    unsigned right_place = data -> current_sector;
+    if ( opt.threads == 0 )
+    {
+	cerr << "Need at least one thread." << endl;
+	ok = false;
+    }
 
-    // This will scan all sectors in this collection from the file.
-    for( unsigned int block_offset = 0; block_offset < data -> sector_read_count * SEC_SIZE; block_offset += SEC_SIZE, right_place++ )
+    if ( opt.disk_chunk == 0 || opt.file_chunk == 0 )
     {
-        // If we already have a 100% match on this block just skip the test.
-        if ( data -> match[ right_place ] < 10 )
-        {
-            for( unsigned int disk_offset = 0; disk_offset < disk_chunk; disk_offset += SEC_SIZE )
-            {
-                unsigned int result = papm_rl( (const unsigned char *) data -> disk + disk_offset, SEC_SIZE,
-                                               (const unsigned char *) data -> buf + block_offset, SEC_SIZE );
-                // 10 = 100% match
-                //  9 = >90% match
-                //  8 = >80% match
-                // ...
-                // And the highest score wins.
-                unsigned int per = ( result * 10 ) / SEC_SIZE;
-                if ( per > data -> match[ right_place ] )
-                    data -> match[ right_place ] = per;
-                
-            }
-        }
+	cerr << "The chunk sizes can't be zero." << endl;
+	ok = false;
     }
-    
-    return( NULL );
-}
 
-// ============================================================
-//
-// log
-//
-// If/when we do this threaded this will be important since it can be
-// made to lock.
-//
-// ============================================================
+    // Nobody asked for this -f, so just bring it down to fit - a small
+    // -c on its own has always worked.
+    if ( opt.file_chunk > opt.disk_chunk && ! ( opt.given & TUNE_FILE_CHUNK ) )
+	opt.file_chunk = opt.disk_chunk;
 
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // --tune only ever picks a file chunk no bigger than the disk
+    // chunk, so a given -f bigger than the default -c is fine there.
+    if ( opt.file_chunk > opt.disk_chunk && ! ( opt.tune && ! ( opt.given & TUNE_DISK_CHUNK ) ) )
+    {
+	cerr << "The file/pattern chunk size (" << opt.file_chunk << ") can't be bigger than"
+	     << " the disk chunk size (" << opt.disk_chunk << ")." << endl;
+	ok = false;
+    }
 
-void log( unsigned int importance, const char * format, ... )
-{
-    if ( log_level >= importance )
+    if ( opt.disk_chunk % SEC_SIZE )
     {
-        char buffer[ 256 ];
-        va_list args;
-        pthread_mutex_lock( &lock );
-        va_start( args, format );
-        vsprintf( buffer, format, args );
-        cout << buffer << std::flush;
-        va_end( args );
-        pthread_mutex_unlock( &lock );
+	cerr << "The disk chunk size must be a multiple of " << SEC_SIZE << "." << endl
+	     << "Might I suggest 1048576 a.k.a. 0x100000?" << endl;
+	ok = false;
     }
-}
 
-// ============================================================
-//
-// For testing.
-//
-// ============================================================
+    if ( opt.file_chunk % SEC_SIZE )
+    {
+	cerr << "The file/pattern chunk size must be a multiple of " << SEC_SIZE << "." << endl
+	     << "Might I suggest 65536 a.k.a. 0x10000?" << endl;
+	ok = false;
+    }
 
-void dump_sector( unsigned char *sec )
-{
-    for( unsigned i = 0; i < 32; i++ )
+    if ( ! ok )
     {
-        for( unsigned j = 0; j < 16; j++ )
-            // Yeah, I know, it's C++ and not C.
-            printf( "%02X ", sec[ i*16 + j ] );
-        for( unsigned j = 0; j < 16; j++ )
-            if ( isprint( sec[ i*16 + j ] ) )
-                putchar( sec[ i*16 + j ] );
-            else
-                putchar( '.' );
-        putchar( '\n' );
+        cerr << "Usage: " << av[ 0 ]
+	     << ": [serve | query | coordinate] [-d <device>] [-p <patterndir>] [-t <threads>] [-c <diskchunk>] [-f <filechunk>]" << endl
+	     << "       [-s <socket>] [-o <output>] [--shard <i>/<N>] [-n <workers>] [--hosts <h1,h2,...>] [--remote <scar>]" << endl
+	     << "       [--numa] [--cpu-offset <n>] [--hugepages] [--tune] [--profile <profile>]" << endl
+	     << "       " << av[ 0 ] << " query [-s <socket>] --forget | --shutdown" << endl
+	     << "       " << av[ 0 ] << " merge [-o <output>] <partial> ..." << endl
+	     << "       serve stays running on <socket> and keeps images and patterns loaded" << endl
+	     << "       query asks a running server to search <device> for <patterndir>" << endl
+	     << "       --forget has the server drop what it has loaded, --shutdown stops it" << endl
+	     << "       --shard searches only piece <i> (from 0) of <N> pieces of <device>" << endl
+	     << "       merge combines the output of the --shard runs, best score per sector" << endl
+	     << "       coordinate runs <workers> shards (on <hosts> over ssh if given) and merges them" << endl
+	     << "       --numa pins threads over the sockets with node local buffers and reports per node rates" << endl
+	     << "       --cpu-offset starts the --numa pinning at the n'th CPU, so that shards on one machine don't share" << endl
+	     << "       --hugepages puts the disk chunk buffers on 2M pages" << endl
+	     << "       --tune times the device and patterns here and picks whichever of -t -c -f weren't given" << endl
+	     << "       --profile saves what --tune picked, or without --tune uses a saved one" << endl
+	     << "       <device> has the file system" << endl
+             << "       <patterndir> is a directory with file patterns" << endl
+	     << "       <threads> is the numbe rof threads to start" << endl
+	     << "       <diskchunk> is the size of the chunk to read from the drive, multiple of " << SEC_SIZE << endl
+	     << "       <filechunk> is the size of the chunk to read for each pattern, multiple of " << SEC_SIZE << endl
+	     << "       Defaults: -d/data/bill_disk_images/FAT1G -p./patterns -t" << opt.threads
+	     << " -c" << opt.disk_chunk << " -f" << opt.file_chunk << " -s" << opt.socket
+	     << endl;
+        exit( 1 );
     }
+
+    return( ok );
 }
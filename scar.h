@@ -0,0 +1,53 @@
+// ============================================================
+//
+// scar.h
+//
+// Things shared between the pieces of the command line tool. The
+// search itself is in scar_engine.h / libscar.a.
+//
+// ============================================================
+
+#ifndef SCAR_H
+#define SCAR_H
+
+#include "scar_engine.h"
+#include "scar_tune.h"
+
+enum mode_e {
+    scan_mode = 0,  // Plain old scar run
+    serve_mode,     // scar serve - long running daemon on a socket
+    query_mode,     // scar query - ask a running daemon to do a scan
+    merge_mode,     // scar merge - combine the output of --shard runs
+    coordinate_mode // scar coordinate - run and merge the shards for us
+};
+
+// Everything that came in on the command line.
+struct scar_options {
+    enum mode_e  mode;
+    const char   *device;      // The name of the device to examine
+    const char   *patterns;    // The directory with the patterns
+    const char   *socket;      // Where "serve" listens and "query" connects
+    const char   *output;      // Results go here instead of stdout
+    const char   *request;     // What "query" asks for - "scan", "forget" or "shutdown"
+    off64_t      disk_chunk;   // Read this many from the device
+    off64_t      file_chunk;   // One chunk's worth out of the file we're looking for
+    unsigned int threads;      // How many do you want to run?
+    unsigned int flags;        // SCAR_NUMA and/or SCAR_HUGEPAGES for the engine
+    unsigned int given;        // TUNE_THREADS etc. for -t / -c / -f seen on the command line
+    bool         tune;         // Work out the best -t / -c / -f before the search
+    const char   *profile;     // Where --tune saves its answer, or where to load one from
+    unsigned int shard;        // Which piece of the disk is ours (from 0)...
+    unsigned int shards;       // ...out of this many
+    unsigned int cpu_offset;   // With --numa, where in the CPU list our threads start
+    unsigned int workers;      // How many shards "coordinate" runs
+    const char   *hosts;       // Comma separated ssh hosts for "coordinate"
+    const char   *remote;      // The scar program on those hosts
+    std::vector<const char *> files; // Partial results for "merge"
+};
+
+int serve( const scar_options &opt );
+int query( const scar_options &opt, std::ostream &out );
+int merge( const scar_options &opt, std::ostream &out );
+int coordinate( const scar_options &opt, std::ostream &out );
+
+#endif
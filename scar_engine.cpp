@@ -0,0 +1,1319 @@
+// ============================================================
+//
+// scar_engine.cpp
+//
+// The DNA inspired slack space search itself. See scar_engine.h for
+// how to drive it and scar.cpp for the command line tool.
+//
+// Note: This will not work (and possibly even segfault) if:
+//       -- <file_chunk> (the size of the pattern) is < the size of a machine word
+//       -- <file_chunk> (the size of the pattern) is > <disk_chunk>
+//       -- the size of the text is < the size of the machine word
+//
+// ============================================================
+
+#include "scar_engine.h"
+#include "scar_numa.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <new>
+
+#define POSIX_THREADS 1 // Use threads?
+
+using namespace std;
+
+unsigned int log_level = 0;
+
+// How much the engine keeps around between runs. Past these the least
+// recently used images / pattern sets are dropped.
+const unsigned int MAX_CACHED_IMAGES = 16;
+const off64_t      MAX_CACHED_PATTERN_BYTES = 1024LL * 1024 * 1024;
+
+enum status_e {
+	       available = 1,
+	       needs_data,
+	       needs_cpu,
+	       completed
+};
+
+static const char *status_e[] = {
+			  "oops",
+			  "available",
+			  "needs_data",
+			  "needs_cpu",
+			  "completed"
+};
+
+// The structure that goes back and forth to the threads
+struct search_s {
+    enum status_e       status;            // What is this one up to now?
+    const char          *filename;         // Points into the pattern set, don't free it
+    const unsigned char *pattern;          // The whole pattern file if it's in memory...
+    int                 fd;                // ...else open on it, for reading as we go
+    off64_t             pattern_size;      // And how big it is
+    const unsigned char *disk;             // Points at a chunk of the disk
+    off64_t             disk_size;         // How many bytes in that chunk?
+    unsigned char       *buf;              // Points at a chunk of the file
+    unsigned char       *match;            // The score array for this file (bytes)
+    unsigned int        sector_read_count; // How many did we get on the last load?
+    unsigned int        current_sector;    // Where are we in the file?
+    unsigned int        total_sectors;     // How many sectors total?
+    unsigned int        scans;             // How many scans (disk chunks) so far?
+    unsigned int        me;                // So that the threads know what to log
+    unsigned int        node;              // Index into ScanEngine::nodes
+    int                 cpu;               // Pinned here, or -1
+    unsigned long long  compares;          // Sectors compared this run
+    double              busy;              // Seconds spent in scan_disk_blocks this run
+    pthread_t           tid;               // From pthread_create
+};
+
+// ============================================================
+//
+// ScanEngine
+//
+// The pointer to the file buffer in each slot of the search set is
+// set up once and left. The disk buffers wait for the first run(),
+// since an engine that never runs doesn't need them.
+//
+// With SCAR_NUMA slot i gets CPU <cpu_offset> + i from numa_cpus(),
+// which takes the nodes in turn, so the threads split evenly over the
+// sockets.
+//
+// ============================================================
+
+ScanEngine::ScanEngine( off64_t disk_chunk, off64_t file_chunk, unsigned int threads, unsigned int flags,
+                        unsigned int cpu_offset )
+    : disk_chunk( disk_chunk ), file_chunk( file_chunk ), threads( threads ), flags( flags ), good( true ), uses( 0 )
+{
+    vector<numa_cpu_s> cpus;
+    if ( flags & SCAR_NUMA )
+    {
+        cpus = numa_cpus();
+        if ( cpu_offset + threads > cpus.size() )
+            cerr << "Only " << cpus.size() << " CPUs to pin to, so CPUs " << cpu_offset << " to "
+                 << cpu_offset + threads - 1 << " will double up." << endl;
+    }
+
+    // We're a library - if there's no memory, say so and let ok() tell
+    // the caller rather than exiting out from under them.
+    search_set = (search_s *) calloc( threads, sizeof( search_s ) );
+    if ( ! search_set )
+    {
+        cerr << "malloc failed!?" << endl;
+        this -> threads = 0;
+        good = false;
+        staged = false;
+        return;
+    }
+
+    node_s none;
+    none.node = -1;
+    none.cpu = -1;
+    none.buffer[ 0 ] = none.buffer[ 1 ] = NULL;
+    none.disk = NULL;
+    if ( cpus.empty() )
+        nodes.push_back( none );
+
+    for( unsigned int i = 0; i < threads; i++ )
+    {
+	search_set[ i ].status = available;
+        search_set[ i ].me = i;
+        search_set[ i ].cpu = -1;
+        search_set[ i ].node = 0;
+        search_set[ i ].fd = -1;
+
+        if ( ! cpus.empty() )
+        {
+            const numa_cpu_s &cpu = cpus[ ( cpu_offset + i ) % cpus.size() ];
+            search_set[ i ].cpu = cpu.cpu;
+            while ( search_set[ i ].node < nodes.size() && nodes[ search_set[ i ].node ].node != cpu.node )
+                search_set[ i ].node++;
+            if ( search_set[ i ].node == nodes.size() )
+            {
+                nodes.push_back( none );
+                nodes.back().node = cpu.node;
+                nodes.back().cpu = cpu.cpu;
+            }
+            search_set[ i ].buf = (unsigned char *) numa_alloc( file_chunk, cpu.node, cpu.cpu, false );
+        }
+        else
+            search_set[ i ].buf = (unsigned char *) malloc( file_chunk );
+
+        if ( ! search_set[ i ].buf )
+        {
+            cerr << "malloc failed!?" << endl;
+            good = false;
+            break;
+        }
+    }
+
+    // One node and ordinary pages? Then the threads can look right at
+    // the one read buffer like they always have.
+    staged = ( flags & SCAR_HUGEPAGES ) || nodes.size() > 1;
+    if ( flags & SCAR_NUMA )
+        log( 1, "%u threads over %u NUMA nodes\n", threads, (unsigned) nodes.size() );
+}
+
+ScanEngine::~ScanEngine()
+{
+    forget();
+    for( unsigned int i = 0; i < threads; i++ )
+    {
+        if ( search_set[ i ].cpu >= 0 )
+            numa_free( search_set[ i ].buf, file_chunk, false );
+        else
+            free( search_set[ i ].buf );
+        free( search_set[ i ].match );
+    }
+    free( search_set );
+
+    for( unsigned int n = 0; n < nodes.size(); n++ )
+        for( unsigned int b = 0; b < 2; b++ )
+            if ( staged )
+                numa_free( nodes[ n ].buffer[ b ], disk_chunk, flags & SCAR_HUGEPAGES );
+            else
+                free( nodes[ n ].buffer[ b ] );
+}
+
+// ============================================================
+//
+// get_stamp / same
+//
+// Has a file changed since we loaded it? New inode (replaced), new
+// size or new modification time all count.
+//
+// ============================================================
+
+bool ScanEngine::get_stamp( const char *path, stamp_s &stamp )
+{
+    struct stat info;
+    if ( stat( path, &info ) != 0 )
+        return( false );
+    stamp.dev = info.st_dev;
+    stamp.ino = info.st_ino;
+    stamp.size = info.st_size;
+    stamp.sec = info.st_mtim.tv_sec;
+    stamp.nsec = info.st_mtim.tv_nsec;
+    return( true );
+}
+
+bool ScanEngine::same( const stamp_s &a, const stamp_s &b )
+{
+    return( a.dev == b.dev && a.ino == b.ino && a.size == b.size && a.sec == b.sec && a.nsec == b.nsec );
+}
+
+// ============================================================
+//
+// attach_image
+//
+// Make sure that we can open the device, since you might need to be
+// "sudo" to do it. We need to make sure that the chunk size for the
+// disk image does not leave any fractional reads or we may get false
+// positives on the slack space.
+//
+// ============================================================
+
+int ScanEngine::attach_image( const char *device )
+{
+    stamp_s now;
+    memset( &now, 0, sizeof( now ) );
+    bool exists = get_stamp( device, now );
+    int slot = -1;
+
+    for( unsigned int i = 0; i < images.size(); i++ )
+        if ( images[ i ].fd >= 0 && images[ i ].path == device )
+        {
+            if ( exists && same( images[ i ].stamp, now ) )
+            {
+                images[ i ].used = ++uses;
+                return( i );
+            }
+            log( 1, "%s has changed, opening it again\n", device );
+            drop_image( i );
+            slot = i;
+        }
+
+    image_s image;
+    image.path = device;
+    image.fd = open( device, O_RDONLY );
+    if ( image.fd < 0 )
+    {
+        cerr << "Error opening the device " << device << ".\n";
+        if ( geteuid() != 0 )
+            cerr << "Maybe you need to be sudo'd? Or does it not exist?\n";
+        perror( "open" );
+        return( -1 );
+    }
+
+    image.size = lseek64( image.fd, (off64_t) 0, SEEK_END );
+    if ( image.size <= 0 )
+    {
+        cerr << "The device " << device << " seems to be empty.\n";
+        close( image.fd );
+        return( -1 );
+    }
+
+    if ( image.size < disk_chunk )
+    {
+        log( 0, "Adjusting disk_chunk setting down to actual size of %llu\n", (unsigned long long) image.size );
+        image.chunk = image.size;
+        image.loops = 1;
+    }
+    else
+    {
+        if ( image.size % disk_chunk != 0 )
+        {
+            // This is a problem. For now just punt.
+            cerr << "The actual image size in bytes is not divisible by " << disk_chunk << "\n";
+            close( image.fd );
+            return( -1 );
+        }
+        else
+        {
+            log( 1, "The setting for disk_chunk looks good - %llu\n", (unsigned long long) disk_chunk );
+            image.chunk = disk_chunk;
+            image.loops = image.size / disk_chunk;
+        }
+    }
+
+    // We go through it front to back, so let the kernel read ahead
+    // as far as it likes. (Not mapped on purpose - on a failing disk
+    // a bad sector in a mapping is a SIGBUS, which would take "scar
+    // serve" down with it. A failed pread() is just a failed run.)
+    posix_fadvise( image.fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    if ( ! get_stamp( device, image.stamp ) )
+        memset( &image.stamp, 0, sizeof( image.stamp ) );
+    image.used = ++uses;
+
+    // Reuse a dropped slot if there is one so the handles stay small.
+    for( unsigned int i = 0; i < images.size() && slot < 0; i++ )
+        if ( images[ i ].fd < 0 )
+            slot = i;
+    if ( slot < 0 )
+    {
+        slot = images.size();
+        images.push_back( image );
+    }
+    else
+        images[ slot ] = image;
+
+    trim_cache( slot, -1 );
+    return( slot );
+}
+
+// ============================================================
+//
+// load_patterns
+//
+// Find every regular file in the directory (other than the dot files)
+// and, with SCAR_KEEP_PATTERNS, read them into memory. A file that
+// won't open is reported and skipped.
+//
+// ============================================================
+
+int ScanEngine::load_patterns( const char *directory )
+{
+    int slot = -1;
+
+    for( unsigned int i = 0; i < pattern_sets.size(); i++ )
+        if ( ! pattern_sets[ i ].directory.empty() && pattern_sets[ i ].directory == directory )
+        {
+            if ( ! stale( pattern_sets[ i ] ) )
+            {
+                pattern_sets[ i ].used = ++uses;
+                return( i );
+            }
+            log( 1, "Patterns in %s have changed, loading them again\n", directory );
+            slot = i;
+        }
+
+    DIR *dir = opendir( directory );
+    if ( ! dir )
+    {
+        cerr << "Error opening the directory " << directory << ".\n";
+        perror( "opendir" );
+        if ( slot >= 0 )
+            pattern_sets[ slot ] = pattern_set_s();
+        return( -1 );
+    }
+
+    for( unsigned int i = 0; i < pattern_sets.size() && slot < 0; i++ )
+        if ( pattern_sets[ i ].directory.empty() )
+            slot = i;
+    if ( slot < 0 )
+    {
+        slot = pattern_sets.size();
+        pattern_sets.push_back( pattern_set_s() );
+    }
+
+    // Build it in place so that we aren't copying pattern data around.
+    pattern_set_s &set = pattern_sets[ slot ];
+    set = pattern_set_s();
+    set.directory = directory;
+    set.used = ++uses;
+    set.bytes = 0;
+    // Stamp the directory before reading it, so that a file added
+    // while we read makes it look stale next time rather than never.
+    if ( ! get_stamp( directory, set.stamp ) )
+        memset( &set.stamp, 0, sizeof( set.stamp ) );
+
+    // Keep the contents only if asked to, and only while they fit.
+    bool keeping = flags & SCAR_KEEP_PATTERNS;
+
+    struct dirent *nextfile;
+    errno = 0; // The global one in <errno.h>
+    while ( ( nextfile = readdir( dir ) ) )
+    {
+        if ( nextfile -> d_name[ 0 ] != '.' )
+        {
+            string filename = directory;
+            if ( filename[ filename.size() - 1 ] != '/' )
+                filename += '/';
+            filename += nextfile -> d_name;
+
+            set.files.push_back( pattern_s() );
+            pattern_s &pattern = set.files.back();
+            if ( ! read_pattern( filename, pattern, keeping ? MAX_CACHED_PATTERN_BYTES - set.bytes : -1 ) )
+                set.files.pop_back();
+            else if ( keeping && (off64_t) pattern.data.size() != pattern.size )
+            {
+                log( 1, "The patterns in %s won't all fit in memory, reading them as we go\n", directory );
+                keeping = false;
+                for( unsigned int f = 0; f < set.files.size(); f++ )
+                    vector<unsigned char>().swap( set.files[ f ].data );
+                set.bytes = 0;
+            }
+            else
+                set.bytes += pattern.data.size();
+        }
+        errno = 0;
+    }
+
+    if ( errno != 0 )
+    {
+        cerr << "Error reading the pattern directory " << directory << ".\n";
+        perror( "readdir" );
+    }
+    closedir( dir );
+
+    log( 1, "Loaded %u patterns from %s\n", (unsigned) set.files.size(), directory );
+    trim_cache( -1, slot );
+    return( slot );
+}
+
+// Read the file into pattern.data if it's no bigger than <room>;
+// otherwise (or if <room> is negative) just note how big it is.
+bool ScanEngine::read_pattern( const string &filename, pattern_s &pattern, off64_t room )
+{
+    // Only plain files. A subdirectory would "read" as some huge size
+    // and a FIFO would hang us (and the server) forever.
+    struct stat info;
+    if ( stat( filename.c_str(), &info ) != 0 || ! S_ISREG( info.st_mode ) )
+    {
+        log( 1, "Skipping %s, it isn't a regular file\n", filename.c_str() );
+        return( false );
+    }
+
+    // Stamp it before reading, same as the directory.
+    if ( ! get_stamp( filename.c_str(), pattern.stamp ) )
+        memset( &pattern.stamp, 0, sizeof( pattern.stamp ) );
+
+    // Non blocking in case it got swapped for a FIFO since the stat.
+    int fd = open( filename.c_str(), O_RDONLY | O_NONBLOCK );
+    if ( fd < 0 )
+    {
+        perror( filename.c_str() );
+        return( false );
+    }
+    if ( fstat( fd, &info ) != 0 || ! S_ISREG( info.st_mode ) )
+    {
+        log( 1, "Skipping %s, it isn't a regular file\n", filename.c_str() );
+        close( fd );
+        return( false );
+    }
+
+    pattern.filename = filename;
+    pattern.size = info.st_size;
+    if ( room < 0 || info.st_size > room )
+    {
+        close( fd );
+        return( true );
+    }
+
+    try
+    {
+        pattern.data.resize( info.st_size );
+    }
+    catch ( bad_alloc & )
+    {
+        // Then it'll just have to be read as we go.
+        close( fd );
+        return( true );
+    }
+
+    off64_t have = 0;
+    while ( have < (off64_t) pattern.data.size() )
+    {
+        ssize_t count = read( fd, &pattern.data[ have ], pattern.data.size() - have );
+        if ( count < 0 && errno == EINTR )
+            continue;
+        if ( count < 0 )
+        {
+            perror( filename.c_str() );
+            close( fd );
+            return( false );
+        }
+        if ( count == 0 )
+            break;
+        have += count;
+    }
+    pattern.data.resize( have );
+    pattern.size = have;
+    close( fd );
+    return( true );
+}
+
+// ============================================================
+//
+// stale
+//
+// A pattern set is out of date if the directory changed (files added,
+// removed or renamed) or any one of the files did. That's a stat per
+// pattern per request, which is nothing next to the search.
+//
+// ============================================================
+
+bool ScanEngine::stale( const pattern_set_s &set )
+{
+    stamp_s now;
+    if ( ! get_stamp( set.directory.c_str(), now ) || ! same( set.stamp, now ) )
+        return( true );
+    for( unsigned int f = 0; f < set.files.size(); f++ )
+        if ( ! get_stamp( set.files[ f ].filename.c_str(), now ) || ! same( set.files[ f ].stamp, now ) )
+            return( true );
+    return( false );
+}
+
+// ============================================================
+//
+// drop_image / trim_cache / forget
+//
+// Dropped entries stay in the vectors as holes so that the other
+// handles keep meaning the same thing.
+//
+// ============================================================
+
+void ScanEngine::drop_image( unsigned int i )
+{
+    if ( images[ i ].fd >= 0 )
+        close( images[ i ].fd );
+    images[ i ].fd = -1;
+    images[ i ].path.clear();
+}
+
+void ScanEngine::trim_cache( int keep_image, int keep_set )
+{
+    for( ;; )
+    {
+        unsigned int open_images = 0;
+        int oldest = -1;
+        for( unsigned int i = 0; i < images.size(); i++ )
+            if ( images[ i ].fd >= 0 )
+            {
+                open_images++;
+                if ( (int) i != keep_image && ( oldest < 0 || images[ i ].used < images[ oldest ].used ) )
+                    oldest = i;
+            }
+        if ( open_images <= MAX_CACHED_IMAGES || oldest < 0 )
+            break;
+        log( 1, "Closing %s to make room\n", images[ oldest ].path.c_str() );
+        drop_image( oldest );
+    }
+
+    for( ;; )
+    {
+        off64_t bytes = 0;
+        int oldest = -1;
+        for( unsigned int i = 0; i < pattern_sets.size(); i++ )
+            if ( ! pattern_sets[ i ].directory.empty() )
+            {
+                bytes += pattern_sets[ i ].bytes;
+                if ( (int) i != keep_set && ( oldest < 0 || pattern_sets[ i ].used < pattern_sets[ oldest ].used ) )
+                    oldest = i;
+            }
+        if ( bytes <= MAX_CACHED_PATTERN_BYTES || oldest < 0 )
+            break;
+        log( 1, "Dropping the patterns from %s to make room\n", pattern_sets[ oldest ].directory.c_str() );
+        pattern_sets[ oldest ] = pattern_set_s();
+    }
+}
+
+void ScanEngine::forget()
+{
+    for( unsigned int i = 0; i < images.size(); i++ )
+        drop_image( i );
+    images.clear();
+    pattern_sets.clear();
+}
+
+// ============================================================
+//
+// fetch_chunk
+//
+// Read chunk number <chunk> of the image into <buffer>, then ask the
+// kernel to start on the chunk after it. That one is needed next time
+// around, and in the meantime the threads are busy for a while anyhow.
+//
+// ============================================================
+
+const unsigned char *ScanEngine::fetch_chunk( const image_s &image, off64_t chunk, unsigned char *buffer )
+{
+    off64_t offset = chunk * image.chunk;
+    off64_t have = 0;
+
+    while ( have < image.chunk )
+    {
+        ssize_t count = pread64( image.fd, buffer + have, image.chunk - have, offset + have );
+        if ( count < 0 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+        {
+            cerr << "Error reading the device " << image.path << " at " << offset + have << ".\n";
+            if ( count < 0 )
+                perror( "read" );
+            else
+                cerr << "It seems to have gotten shorter.\n";
+            return( NULL );
+        }
+        have += count;
+    }
+
+    if ( offset + 2 * image.chunk <= image.size )
+        posix_fadvise( image.fd, offset + image.chunk, image.chunk, POSIX_FADV_WILLNEED );
+    return( buffer );
+}
+
+// ============================================================
+//
+// load_chunk
+//
+// Get chunk <chunk> into buffer set <which> and work out what each
+// node's threads should look at. When staged every node gets its own
+// copy; that's a memcpy per node per chunk, which is nothing next to
+// what the threads then do with it.
+//
+// ============================================================
+
+bool ScanEngine::load_chunk( const image_s &image, off64_t chunk, unsigned int which )
+{
+    const unsigned char *source = fetch_chunk( image, chunk, nodes[ 0 ].buffer[ which ] );
+    if ( ! source )
+        return( false );
+
+    for( unsigned int n = 0; n < nodes.size(); n++ )
+        if ( staged && source != nodes[ n ].buffer[ which ] )
+        {
+            memcpy( nodes[ n ].buffer[ which ], source, image.chunk );
+            nodes[ n ].disk = nodes[ n ].buffer[ which ];
+        }
+        else
+            nodes[ n ].disk = source;
+    return( true );
+}
+
+// ============================================================
+//
+// report
+//
+// Per node numbers for a SCAR_NUMA run, so that we can see whether
+// adding a socket actually bought us anything.
+//
+// ============================================================
+
+void ScanEngine::report( double seconds )
+{
+    for( unsigned int n = 0; n < nodes.size(); n++ )
+    {
+        unsigned int count = 0;
+        unsigned long long compares = 0;
+        double busy = 0;
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].node == n )
+            {
+                count++;
+                compares += search_set[ i ].compares;
+                busy += search_set[ i ].busy;
+            }
+
+        double millions = compares / 1e6;
+        cerr << "node " << nodes[ n ].node << ": " << count << " threads, "
+             << millions << "M sector compares, "
+             << ( seconds > 0 ? millions / seconds : 0 ) << "M/s, "
+             << ( busy > 0 ? millions / busy : 0 ) << "M/s per busy thread second" << endl;
+    }
+}
+
+// ============================================================
+//
+// finish
+//
+// Hand the results for a finished slot to the caller and clean up the
+// slot so that it can be reused.
+//
+// ============================================================
+
+void ScanEngine::finish( search_s &slot, scar_result_fn callback, void *context )
+{
+    scar_result result;
+
+    result.filename = slot.filename;
+    result.total_sectors = slot.total_sectors;
+    result.score = overall_score( slot.match, slot.total_sectors );
+    result.match = slot.match;
+    if ( callback )
+        callback( result, context );
+
+    free( slot.match );
+    slot.match = NULL;
+    slot.filename = NULL;
+    slot.pattern = NULL;
+    if ( slot.fd >= 0 )
+        close( slot.fd );
+    slot.fd = -1;
+    slot.status = available;
+}
+
+// ============================================================
+//
+// start_pattern
+//
+// Set up an available slot to work through <pattern>. If it isn't in
+// memory it gets opened here and read a chunk at a time as needed.
+// Returns false (after saying why) if it can't be opened now.
+//
+// ============================================================
+
+bool ScanEngine::start_pattern( search_s &slot, const pattern_s &pattern )
+{
+    log( 2, "search_set[ %d ].filename = %s\n", slot.me, pattern.filename.c_str() );
+
+    slot.fd = -1;
+    slot.pattern = NULL;
+    if ( ! pattern.data.empty() )
+        slot.pattern = &pattern.data[ 0 ];
+    else if ( pattern.size > 0 )
+    {
+        slot.fd = open( pattern.filename.c_str(), O_RDONLY | O_NONBLOCK );
+        if ( slot.fd < 0 )
+        {
+            perror( pattern.filename.c_str() );
+            return( false );
+        }
+    }
+
+    // We want to make this LESS than the actual total number of sectors because
+    // the last sector of the file will be partially filled anyhow so not 100% match.
+    slot.filename = pattern.filename.c_str();
+    slot.pattern_size = pattern.size;
+    slot.total_sectors = pattern.size / SEC_SIZE;
+    slot.current_sector = 0;
+    slot.match = (unsigned char *) calloc( slot.total_sectors, 1 );
+    slot.status = needs_data;
+    slot.sector_read_count = 0;
+    slot.scans = 0;
+    return( true );
+}
+
+// ============================================================
+//
+// fill_pattern
+//
+// Get the next <file_chunk> of the slot's pattern into its buffer. If
+// the file got shorter (or went bad) since we looked, we just stop
+// where the data stops.
+//
+// ============================================================
+
+void ScanEngine::fill_pattern( search_s &slot )
+{
+    off64_t offset = (off64_t) slot.current_sector * SEC_SIZE;
+    off64_t count = slot.pattern_size - offset;
+    if ( count > file_chunk )
+        count = file_chunk;
+
+    if ( count > 0 && slot.pattern )
+        memcpy( slot.buf, slot.pattern + offset, count );
+    else if ( count > 0 )
+    {
+        off64_t have = 0;
+        while ( have < count )
+        {
+            ssize_t got = pread64( slot.fd, slot.buf + have, count - have, offset + have );
+            if ( got < 0 && errno == EINTR )
+                continue;
+            if ( got <= 0 )
+            {
+                if ( got < 0 )
+                    perror( slot.filename );
+                break;
+            }
+            have += got;
+        }
+        count = have;
+    }
+
+    // Like above, don't round the sectors up, truncate the count down.
+    slot.sector_read_count = count > 0 ? count / SEC_SIZE : 0;
+    // If there's not a sector's worth left then don't schedule it.
+    // On the other hand, if there IS data we need some CPU time now.
+    slot.status = ( slot.sector_read_count > 0 ) ? needs_cpu : completed;
+    log( 2, "search_set[ %d ].sector_read_count = %d and status = %s\n", slot.me,
+         slot.sector_read_count, status_e[ slot.status ] );
+}
+
+// ============================================================
+//
+// run
+//
+// The main loop. Every slot gets a pattern; each slot needs to see
+// every chunk of the disk (or of our shard of it) once for each chunk
+// of its pattern. We go around the disk as many times as it takes for
+// all of the patterns to get through.
+//
+// ============================================================
+
+bool ScanEngine::run( int image_handle, int pattern_set, scar_result_fn callback, void *context,
+                      unsigned int shard, unsigned int shards )
+{
+    if ( ! good )
+    {
+        cerr << "ScanEngine::run on an engine that couldn't be set up." << endl;
+        return( false );
+    }
+
+    if ( image_handle < 0 || image_handle >= (int) images.size() || images[ image_handle ].fd < 0 ||
+         pattern_set < 0 || pattern_set >= (int) pattern_sets.size() || pattern_sets[ pattern_set ].directory.empty() ||
+         shards == 0 || shard >= shards )
+    {
+        cerr << "ScanEngine::run given a bad (or dropped) image, pattern set or shard." << endl;
+        return( false );
+    }
+
+    const image_s &image = images[ image_handle ];
+    const vector<pattern_s> &files = pattern_sets[ pattern_set ].files;
+    unsigned int next_pattern = 0;
+
+    // Our piece of the disk is chunks [ first, first + loops ).
+    off64_t first = image.loops * shard / shards;
+    off64_t loops = image.loops * ( shard + 1 ) / shards - first;
+    if ( shards > 1 )
+        log( 1, "Shard %u/%u is disk chunks %llu to %llu\n", shard, shards,
+             (unsigned long long) first, (unsigned long long) ( first + loops - 1 ) );
+
+    // More shards than chunks. Nothing to look at, but say so for
+    // every pattern so that a merge still sees all of them.
+    if ( loops == 0 )
+    {
+        for( unsigned int p = 0; p < files.size(); p++ )
+        {
+            vector<unsigned char> none( files[ p ].size / SEC_SIZE + 1, 0 );
+            scar_result result;
+            result.filename = files[ p ].filename.c_str();
+            result.total_sectors = files[ p ].size / SEC_SIZE;
+            result.score = 0;
+            result.match = &none[ 0 ];
+            if ( callback )
+                callback( result, context );
+        }
+        return( true );
+    }
+
+    if ( ! nodes[ 0 ].buffer[ 0 ] )
+    {
+        bool ok = true;
+        for( unsigned int n = 0; n < nodes.size(); n++ )
+            for( unsigned int b = 0; b < 2; b++ )
+            {
+                if ( staged )
+                    nodes[ n ].buffer[ b ] = (unsigned char *) numa_alloc( disk_chunk, nodes[ n ].node, nodes[ n ].cpu,
+                                                                           flags & SCAR_HUGEPAGES );
+                else
+                    nodes[ n ].buffer[ b ] = (unsigned char *) malloc( disk_chunk );
+                if ( ! nodes[ n ].buffer[ b ] )
+                    ok = false;
+            }
+
+        if ( ! ok )
+        {
+            cerr << "malloc failed!?" << endl;
+            for( unsigned int n = 0; n < nodes.size(); n++ )
+                for( unsigned int b = 0; b < 2; b++ )
+                {
+                    if ( staged )
+                        numa_free( nodes[ n ].buffer[ b ], disk_chunk, flags & SCAR_HUGEPAGES );
+                    else
+                        free( nodes[ n ].buffer[ b ] );
+                    nodes[ n ].buffer[ b ] = NULL;
+                }
+            return( false );
+        }
+    }
+
+    // ============================================================
+    // OK here we go
+    // ============================================================
+
+    log( 1, "Starting up...\n" );
+
+    struct timespec started;
+    clock_gettime( CLOCK_MONOTONIC, &started );
+
+    unsigned int which_disk_buffer = 0;
+    off64_t chunk = first;
+    bool loaded = load_chunk( image, chunk, which_disk_buffer );
+
+    for( unsigned int i = 0; i < threads; i++ )
+    {
+        search_set[ i ].status = available;
+        search_set[ i ].disk = nodes[ search_set[ i ].node ].disk;
+        search_set[ i ].disk_size = image.chunk;
+        search_set[ i ].compares = 0;
+        search_set[ i ].busy = 0;
+    }
+
+    bool more_files_to_do = true;
+    bool keep_going = loaded;
+    while ( keep_going )
+    {
+        log( 2, "Still working... Disk chunk %llu\n", (unsigned long long) chunk );
+
+        // ============================================================
+        // First, see if anybody is now finished. If so, report them
+        // and clean up the slot so that it can be reused. Do this
+        // first so that we can fill all available slots if we have
+        // any.
+        // ============================================================
+
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == completed )
+                finish( search_set[ i ], callback, context );
+
+        // ============================================================
+        // Next look for available "slots" to assign work to.
+        // ============================================================
+
+        for( unsigned int i = 0; i < threads && more_files_to_do; i++ )
+            // Is this slot looking for work?
+            if ( search_set[ i ].status == available )
+            {
+                // A pattern that has gone away since it was listed is skipped.
+                bool started = false;
+                while ( ! started && next_pattern < files.size() )
+                    started = start_pattern( search_set[ i ], files[ next_pattern++ ] );
+                if ( ! started )
+                {
+                    // There's no more pattern files.
+                    more_files_to_do = false;
+                    break;
+                }
+            }
+
+        // ============================================================
+        // Next, load data for any slot that needs it.
+        // ============================================================
+
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_data )
+                fill_pattern( search_set[ i ] );
+
+        // ============================================================
+        // Do the actual scan of this chunk of image with this set of files.
+        // This log is in honor of my 9th grade algebra teacher, Mr. Willard.
+        // He always said this right at the beginning of every class.
+        // ============================================================
+
+        log( 2, "Talking stopped. Work. To. Be. Done!\n" );
+
+        chunk = ( chunk + 1 == first + loops ) ? first : chunk + 1;
+        which_disk_buffer = ( which_disk_buffer == 0 ) ? 1 : 0;
+
+        #if POSIX_THREADS
+        // Start them all in parallel
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_cpu )
+            {
+                pthread_attr_t attr;
+                pthread_attr_init( &attr );
+                if ( search_set[ i ].cpu >= 0 )
+                    numa_pin( &attr, search_set[ i ].cpu );
+                pthread_create( &search_set[ i ].tid, &attr,
+                                scan_disk_blocks, (void *) &search_set[ i ] );
+                pthread_attr_destroy( &attr );
+            }
+        // Let's do the I/O while we wait.
+        loaded = load_chunk( image, chunk, which_disk_buffer );
+        // Then wait for all to finish
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_cpu )
+            {
+                pthread_join( search_set[ i ].tid, NULL );
+                search_set[ i ].scans++;
+            }
+        #else
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_cpu )
+            {
+                scan_disk_blocks( (void *) &search_set[ i ] );
+                search_set[ i ].scans++;
+            }
+        loaded = load_chunk( image, chunk, which_disk_buffer );
+        #endif
+
+        // If the read went bad there's no point in going on. Toss
+        // whatever is in progress.
+        if ( ! loaded )
+        {
+            for( unsigned int i = 0; i < threads; i++ )
+            {
+                free( search_set[ i ].match );
+                search_set[ i ].match = NULL;
+                if ( search_set[ i ].fd >= 0 )
+                    close( search_set[ i ].fd );
+                search_set[ i ].fd = -1;
+                search_set[ i ].status = available;
+            }
+            return( false );
+        }
+
+        // Switch everyone over to use the new disk buffer.
+        for( unsigned int i = 0; i < threads; i++ )
+            search_set[ i ].disk = nodes[ search_set[ i ].node ].disk;
+
+        log( 2, "One disk scan completed...\n" );
+
+        // ============================================================
+        // Slight optimization heuristic. If we have any sets
+        // where all the matches are 100% we may as well mark it
+        // as completed and free up the slot for somebody else.
+        // ============================================================
+
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_cpu )
+            {
+                search_set[ i ].status = completed;
+                for( unsigned int m = 0; m < search_set[ i ].total_sectors; m++ )
+                    if ( search_set[ i ].match[ m ] < 10 )
+                    {
+                        search_set[ i ].status = needs_cpu;
+                        break;
+                    }
+            }
+
+        // ============================================================
+        // See if somebody needs more data. They need data if they
+        // have completed an entire disk scan.
+        // ============================================================
+
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status == needs_cpu )
+            {
+                if ( search_set[ i ].scans == loops )
+                {
+                    search_set[ i ].scans = 0; // Do the disk again
+                    search_set[ i ].status = needs_data;
+                    search_set[ i ].current_sector += search_set[ i ].sector_read_count;
+                }
+            }
+
+        // ============================================================
+        // Finally, if we get to the end of a disk chunk scan and
+        // every slot is available then we must have finished all
+        // the files.
+        // ============================================================
+
+        keep_going = false;
+        for( unsigned int i = 0; i < threads; i++ )
+            if ( search_set[ i ].status != available )
+            {
+                keep_going = true;
+                break;
+            }
+
+        // ============================================================
+        // Debugging - print the status
+        // ============================================================
+
+        log( 2, "search_set[].status = " );
+        for( unsigned int i = 0; i < threads; i ++ )
+            log( 2, "%s ", status_e[ search_set[ i ].status ] );
+        log( 2, "\n" );
+    }
+
+    if ( flags & SCAR_NUMA )
+    {
+        struct timespec ended;
+        clock_gettime( CLOCK_MONOTONIC, &ended );
+        report( ( ended.tv_sec - started.tv_sec ) + ( ended.tv_nsec - started.tv_nsec ) / 1e9 );
+    }
+
+    return( true );
+}
+
+// ============================================================
+// Processor Aware Pattern Matching - right to left
+//
+// t is the text of size n
+// p is the pattern of size m
+//
+// In this algorithm we are not even bothering to attempt any match
+// other than one at the "back end" of t. For our uses this is the
+// only one we are looking at so there's no need to track the
+// "windows" like in the full algorithm from the paper.
+//
+// One modification is that if the entire block is made up of zeros we
+// return 0 to indicate "NO" match at all.
+// ============================================================
+
+unsigned int papm_rl( const unsigned char *t, unsigned int n, const unsigned char *p, unsigned int m )
+{
+
+    unsigned int in_text = n - sizeof( PATTERN_WORD );
+    unsigned int in_pattern = m - sizeof( PATTERN_WORD );
+    unsigned int match_count = 0;
+    bool all_zero = true;
+
+    while ( *( (PATTERN_WORD *) &p[ in_pattern ] ) == *( (PATTERN_WORD *) &t[ in_text ] ) )
+    {
+        match_count += sizeof( PATTERN_WORD );
+
+        // If it's not zero we'll remember this fact.
+        if ( *( (PATTERN_WORD *) &p[ in_pattern ] ) )
+            all_zero = false;
+
+        // Tail end of a word not divisible by the word size?  This is
+	// the case when "in_pattern" becomes zero. We do want to
+	// check the very last (first) word of the pattern so if we
+	// did and now that was element zero then we are done.
+        if ( in_pattern < sizeof( PATTERN_WORD ) )
+            break;
+        else
+        {
+            in_pattern -= sizeof( PATTERN_WORD );
+            in_text -= sizeof( PATTERN_WORD );
+        }
+    }
+
+    // Again, this "should not happen" if we are complete blocks.
+    if ( in_pattern < sizeof( PATTERN_WORD ) )
+        // At most sizeof( PATTERN_WORD ) - 1 iterations.
+        while ( in_pattern != 0 )
+        {
+            --in_pattern; --in_text;
+            if ( p[ in_pattern ] == t[ in_text ] )
+                match_count++;
+            if ( p[ in_pattern ] )
+                all_zero = false;
+        }
+
+    return( all_zero ? 0 : match_count );
+}
+
+// ============================================================
+//
+// scan_disk_blocks
+//
+// Note that the function technically returns a pointer only so that
+// the prototype / signature matches pthread_create.
+//
+// ============================================================
+
+void *scan_disk_blocks( void *param )
+{
+    search_s *data = (search_s *) param;
+    struct timespec started, ended;
+
+    clock_gettime( CLOCK_MONOTONIC, &started );
+
+    // This "should not happen"
+    if ( data -> sector_read_count == 0 )
+    {
+	log( 0, "scan_disk_blocks for thread %u has no sectors? sector_read_count = %u?\n",
+	     data -> me, data -> sector_read_count );
+        data -> status = completed;
+    }
+
+    // Which spot will this map to in the "match" array?
+    unsigned right_place = data -> current_sector;
+
+    // This will scan all sectors in this collection from the file.
+    for( unsigned int block_offset = 0; block_offset < data -> sector_read_count * SEC_SIZE; block_offset += SEC_SIZE, right_place++ )
+    {
+        // If we already have a 100% match on this block just skip the test.
+        if ( data -> match[ right_place ] < 10 )
+        {
+            for( off64_t disk_offset = 0; disk_offset < data -> disk_size; disk_offset += SEC_SIZE )
+            {
+                unsigned int result = papm_rl( data -> disk + disk_offset, SEC_SIZE,
+                                               (const unsigned char *) data -> buf + block_offset, SEC_SIZE );
+                // 10 = 100% match
+                //  9 = >90% match
+                //  8 = >80% match
+                // ...
+                // And the highest score wins.
+                unsigned int per = ( result * 10 ) / SEC_SIZE;
+                if ( per > data -> match[ right_place ] )
+                    data -> match[ right_place ] = per;
+
+            }
+            data -> compares += data -> disk_size / SEC_SIZE;
+        }
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &ended );
+    data -> busy += ( ended.tv_sec - started.tv_sec ) + ( ended.tv_nsec - started.tv_nsec ) / 1e9;
+    return( NULL );
+}
+
+// ============================================================
+//
+// count_compares
+//
+// For --tune: run scan_disk_blocks itself over one disk chunk and
+// <sectors> sectors of pattern, again and again for about <seconds>,
+// and say how many sector compares that came to. The scores are
+// cleared each time around so that nothing gets skipped as already
+// matched.
+//
+// ============================================================
+
+unsigned long long count_compares( const unsigned char *disk, off64_t disk_size,
+                                   const unsigned char *pattern, unsigned int sectors, double seconds )
+{
+    vector<unsigned char> match( sectors, 0 );
+    search_s slot;
+
+    memset( &slot, 0, sizeof( slot ) );
+    slot.fd = -1;
+    slot.status = needs_cpu;
+    slot.disk = disk;
+    slot.disk_size = disk_size;
+    slot.buf = (unsigned char *) pattern;
+    slot.match = &match[ 0 ];
+    slot.sector_read_count = sectors;
+    slot.total_sectors = sectors;
+    slot.cpu = -1;
+
+    do
+    {
+        memset( &match[ 0 ], 0, sectors );
+        scan_disk_blocks( &slot );
+    } while ( slot.busy < seconds );
+
+    return( slot.compares );
+}
+
+// ============================================================
+//
+// overall_score
+//
+// The score for a whole pattern is the average of its sectors. A
+// pattern smaller than a sector has nothing to score.
+//
+// ============================================================
+
+unsigned int overall_score( const unsigned char *match, unsigned int total_sectors )
+{
+    unsigned total = 0;
+
+    for( unsigned int rep = 0; rep < total_sectors; rep++ )
+        total += (unsigned) match[ rep ];
+    return( total_sectors ? total / total_sectors : 0 );
+}
+
+// ============================================================
+//
+// print_result
+//
+// The one line per pattern that scar has always printed. A "*" is a
+// 100% match.
+//
+// ============================================================
+
+void print_result( ostream &out, const scar_result &result )
+{
+    out << result.filename << ": sectors = "
+        << result.total_sectors << " score = ";
+    if ( result.score == 10 )
+        out << "*";
+    else
+        out << result.score;
+    out << " by sector = ";
+    for( unsigned int rep = 0; rep < result.total_sectors; rep++ )
+    {
+        char ch = '*';
+        if ( result.match[ rep ] < 10 )
+            ch = result.match[ rep ] + '0';
+        out << ch;
+    }
+    out << endl;
+}
+
+// ============================================================
+//
+// log
+//
+// If/when we do this threaded this will be important since it can be
+// made to lock.
+//
+// ============================================================
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void log( unsigned int importance, const char * format, ... )
+{
+    if ( log_level >= importance )
+    {
+        char buffer[ 256 ];
+        va_list args;
+        pthread_mutex_lock( &lock );
+        va_start( args, format );
+        vsnprintf( buffer, sizeof( buffer ), format, args );
+        cout << buffer << std::flush;
+        va_end( args );
+        pthread_mutex_unlock( &lock );
+    }
+}
+
+// ============================================================
+//
+// For testing.
+//
+// ============================================================
+
+void dump_sector( unsigned char *sec )
+{
+    for( unsigned i = 0; i < 32; i++ )
+    {
+        for( unsigned j = 0; j < 16; j++ )
+            // Yeah, I know, it's C++ and not C.
+            printf( "%02X ", sec[ i*16 + j ] );
+        for( unsigned j = 0; j < 16; j++ )
+            if ( isprint( sec[ i*16 + j ] ) )
+                putchar( sec[ i*16 + j ] );
+            else
+                putchar( '.' );
+        putchar( '\n' );
+    }
+}
@@ -0,0 +1,192 @@
+// ============================================================
+//
+// scar_engine.h
+//
+// The scan engine behind SCAR. This used to be the body of "main" in
+// scar.cpp; it now lives in libscar.a so that it can be linked into
+// other programs as well as driven by the command line tool and the
+// "serve" daemon.
+//
+// Typical use:
+//     ScanEngine engine( disk_chunk, file_chunk, threads );
+//     int image = engine.attach_image( "/dev/sdb" );
+//     int set   = engine.load_patterns( "./patterns" );
+//     engine.run( image, set, my_callback, my_context );
+//
+// Images stay open and the list of files in each pattern directory is
+// kept, so repeated runs against the same things do not pay for
+// finding them again. Pattern files are read a <file_chunk> at a time
+// as the search gets to them, like they always were, unless the
+// engine was made with SCAR_KEEP_PATTERNS; then their contents stay in
+// memory between runs too (as long as they fit, see below). Images
+// are read with pread() rather than mapped, so that a bad sector is a
+// failed run() and not a SIGBUS.
+//
+// Attaching the same image or loading the same directory twice hands
+// back the handle from the first time, unless it has changed on disk
+// since (a different file, size or modification time, for the image,
+// the directory or any pattern in it), in which case it is reloaded
+// first. Only so much is kept: past 16 open images or 1G of kept
+// pattern data the least recently used ones are dropped, and a single
+// directory bigger than that is read from disk as it goes instead. So use a handle right
+// away rather than keeping it around across other attaches and loads.
+//
+// An engine is not reentrant - one run() at a time. The run itself
+// uses up to <threads> threads.
+//
+// On a multi-socket machine give the constructor SCAR_NUMA. Each
+// thread is then pinned to its own CPU (spread over the sockets), its
+// pattern buffer lives on its node, and every node gets its own copy
+// of each disk chunk instead of half the threads reading across the
+// interconnect. At the end of each run the per node numbers go to
+// cerr. SCAR_HUGEPAGES backs the disk chunk copies with 2M pages,
+// which helps with the really big -c settings. Several engines
+// sharing a machine (the shards of "scar coordinate") should each be
+// given a different <cpu_offset>, so that engine k with t threads
+// starts at CPU k * t of the list instead of all of them piling onto
+// the first t.
+//
+// ============================================================
+
+#ifndef SCAR_ENGINE_H
+#define SCAR_ENGINE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+typedef unsigned long PATTERN_WORD; // On Ubuntu this is 8 bytes
+const unsigned int SEC_SIZE = 512;  // Works better than 4K
+
+extern unsigned int log_level;      // How much information do you want to see?
+
+// One finished pattern, as handed to the callback given to run(). The
+// pointers are only good for the duration of the callback.
+struct scar_result {
+    const char          *filename;      // Pattern file name
+    unsigned int        total_sectors;  // Whole sectors in the pattern
+    unsigned int        score;          // Average of the sector scores, 0..10
+    const unsigned char *match;         // Score per sector, 0..10
+};
+
+typedef void (*scar_result_fn)( const scar_result &result, void *context );
+
+// Flags for the ScanEngine constructor.
+const unsigned int SCAR_NUMA      = 1;  // Pin threads, keep their memory on their node
+const unsigned int SCAR_HUGEPAGES = 2;  // Disk chunk buffers on 2M pages
+const unsigned int SCAR_KEEP_PATTERNS = 4; // Keep pattern contents in memory between runs
+
+struct search_s;
+
+class ScanEngine {
+public:
+    ScanEngine( off64_t disk_chunk, off64_t file_chunk, unsigned int threads, unsigned int flags = 0,
+                unsigned int cpu_offset = 0 );
+    ~ScanEngine();
+
+    // False if the constructor couldn't get its memory (it will have
+    // said so on cerr). run() on such an engine just fails.
+    bool ok() const { return( good ); }
+
+    // Both return a handle for run(), or -1 (after saying why on cerr).
+    int  attach_image( const char *device );
+    int  load_patterns( const char *directory );
+
+    // Search the image for every pattern in the set. The callback is
+    // called from the calling thread once per pattern as it finishes.
+    //
+    // With <shards> > 1 only shard number <shard> (from 0) of the
+    // image is searched. The image is cut into <shards> runs of whole
+    // disk chunks, so taking the best score per sector over all of the
+    // shards gives the same answer as searching the whole image. A
+    // shard with no chunks at all reports every pattern as all zeros.
+    bool run( int image, int pattern_set, scar_result_fn callback, void *context,
+              unsigned int shard = 0, unsigned int shards = 1 );
+
+    // Close every image and drop every pattern library now.
+    void forget();
+
+private:
+    // Enough of a stat() to tell whether a file changed.
+    struct stamp_s {
+        dev_t   dev;
+        ino_t   ino;
+        off64_t size;
+        time_t  sec;   // Modification time
+        long    nsec;
+    };
+
+    struct image_s {
+        std::string         path;   // As given to attach_image, empty once dropped
+        stamp_s             stamp;  // What it looked like when we opened it
+        unsigned long long  used;   // For dropping the least recently used
+        int                 fd;     // Open on the device, -1 once dropped
+        off64_t             size;   // Bytes in the image
+        off64_t             chunk;  // disk_chunk, or less for tiny images
+        off64_t             loops;  // How many chunks are in the image?
+    };
+
+    struct pattern_s {
+        std::string                filename;
+        stamp_s                    stamp;
+        off64_t                    size;  // Bytes in the file when we looked
+        std::vector<unsigned char> data;  // The whole file if it's kept, else empty
+    };
+
+    struct pattern_set_s {
+        std::string            directory;  // Empty once dropped
+        stamp_s                stamp;      // Of the directory itself
+        unsigned long long     used;
+        off64_t                bytes;      // Total of all of the kept data
+        std::vector<pattern_s> files;
+    };
+
+    // Without SCAR_NUMA there is just one of these, node -1.
+    struct node_s {
+        int                 node;          // NUMA node, -1 if we aren't paying attention
+        int                 cpu;           // One of its CPUs, for first touch
+        unsigned char       *buffer[ 2 ];  // Disk chunks, double buffered
+        const unsigned char *disk;         // The chunk this node's threads look at
+    };
+
+    const unsigned char *fetch_chunk( const image_s &image, off64_t chunk, unsigned char *buffer );
+    bool load_chunk( const image_s &image, off64_t chunk, unsigned int which );
+    void report( double seconds );
+    bool read_pattern( const std::string &filename, pattern_s &pattern, off64_t room );
+    bool start_pattern( search_s &slot, const pattern_s &pattern );
+    void fill_pattern( search_s &slot );
+    bool stale( const pattern_set_s &set );
+    static bool get_stamp( const char *path, stamp_s &stamp );
+    static bool same( const stamp_s &a, const stamp_s &b );
+    void drop_image( unsigned int i );
+    void trim_cache( int keep_image, int keep_set );
+    void finish( search_s &slot, scar_result_fn callback, void *context );
+
+    // Not copyable - we own file descriptors and buffers.
+    ScanEngine( const ScanEngine & );
+    ScanEngine &operator=( const ScanEngine & );
+
+    off64_t                    disk_chunk;         // Read this many from the device
+    off64_t                    file_chunk;         // One chunk's worth out of each pattern
+    unsigned int               threads;            // How many do you want to run?
+    unsigned int               flags;              // SCAR_NUMA etc.
+    bool                       good;               // See ok()
+    bool                       staged;             // Copy each chunk into every node's buffer?
+    std::vector<node_s>        nodes;
+    search_s                   *search_set;        // One slot per thread
+    std::vector<image_s>       images;             // Handles index these, so dropped ones leave a hole
+    std::vector<pattern_set_s> pattern_sets;
+    unsigned long long         uses;               // Ticks on every attach / load
+};
+
+unsigned int papm_rl( const unsigned char *t, unsigned int n, const unsigned char *p, unsigned int m );
+void *scan_disk_blocks( void *params );
+unsigned long long count_compares( const unsigned char *disk, off64_t disk_size,
+                                   const unsigned char *pattern, unsigned int sectors, double seconds );
+unsigned int overall_score( const unsigned char *match, unsigned int total_sectors );
+void print_result( std::ostream &out, const scar_result &result );
+void log( unsigned int, const char * format, ... );
+void dump_sector( unsigned char *sec );
+
+#endif
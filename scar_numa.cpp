@@ -0,0 +1,216 @@
+// ============================================================
+//
+// scar_numa.cpp
+//
+// See scar_numa.h. On a machine (or container) without
+// /sys/devices/system/node everything is node 0, and if the kernel
+// won't let us mbind then first touch has to do.
+//
+// ============================================================
+
+#include "scar_numa.h"
+#include "scar_engine.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+const int MPOL_PREFERRED_MODE = 1; // From <numaif.h>, which we don't want to need
+const int MAX_NODES = 1024;
+
+// ============================================================
+//
+// read_cpulist
+//
+// Turn something like "0-3,8-11" from sysfs into the list of CPUs,
+// keeping only those in <allowed>.
+//
+// ============================================================
+
+static vector<int> read_cpulist( const char *filename, const cpu_set_t &allowed )
+{
+    vector<int> cpus;
+    FILE *in = fopen( filename, "r" );
+    if ( ! in )
+        return( cpus );
+
+    int first, last;
+    char sep;
+    while ( fscanf( in, "%d", &first ) == 1 )
+    {
+        last = first;
+        if ( fscanf( in, "%c", &sep ) == 1 && sep == '-' )
+        {
+            if ( fscanf( in, "%d", &last ) != 1 )
+                break;
+            if ( fscanf( in, "%c", &sep ) != 1 )
+                sep = '\n';
+        }
+        for( int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++ )
+            if ( CPU_ISSET( cpu, &allowed ) )
+                cpus.push_back( cpu );
+        if ( sep != ',' )
+            break;
+    }
+    fclose( in );
+    return( cpus );
+}
+
+vector<numa_cpu_s> numa_cpus()
+{
+    cpu_set_t allowed;
+    CPU_ZERO( &allowed );
+    if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) != 0 )
+        for( int cpu = 0; cpu < sysconf( _SC_NPROCESSORS_ONLN ) && cpu < CPU_SETSIZE; cpu++ )
+            CPU_SET( cpu, &allowed );
+
+    vector<int> nodes;
+    vector< vector<int> > node_cpus;
+
+    DIR *dir = opendir( "/sys/devices/system/node" );
+    if ( dir )
+    {
+        struct dirent *entry;
+        while ( ( entry = readdir( dir ) ) )
+        {
+            int node;
+            char extra;
+            if ( sscanf( entry -> d_name, "node%d%c", &node, &extra ) != 1 || node >= MAX_NODES )
+                continue;
+            char filename[ 512 ];
+            snprintf( filename, sizeof( filename ), "/sys/devices/system/node/%s/cpulist", entry -> d_name );
+            vector<int> cpus = read_cpulist( filename, allowed );
+            if ( ! cpus.empty() )
+            {
+                nodes.push_back( node );
+                node_cpus.push_back( cpus );
+            }
+        }
+        closedir( dir );
+    }
+
+    // No NUMA information - call it all node 0.
+    if ( nodes.empty() )
+    {
+        nodes.push_back( 0 );
+        node_cpus.push_back( vector<int>() );
+        for( int cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+            if ( CPU_ISSET( cpu, &allowed ) )
+                node_cpus[ 0 ].push_back( cpu );
+    }
+
+    vector<numa_cpu_s> result;
+    for( unsigned int round = 0; ; round++ )
+    {
+        bool any = false;
+        for( unsigned int n = 0; n < nodes.size(); n++ )
+            if ( round < node_cpus[ n ].size() )
+            {
+                numa_cpu_s one;
+                one.cpu = node_cpus[ n ][ round ];
+                one.node = nodes[ n ];
+                result.push_back( one );
+                any = true;
+            }
+        if ( ! any )
+            break;
+    }
+    return( result );
+}
+
+// ============================================================
+//
+// numa_alloc / numa_free
+//
+// With hugepages the size is rounded up to a whole 2M page whether or
+// not we got real ones, so that numa_free always unmaps exactly what
+// we mapped.
+//
+// ============================================================
+
+struct touch_s {
+    void   *mem;
+    size_t size;
+};
+
+static void *first_touch( void *param )
+{
+    touch_s *touch = (touch_s *) param;
+    memset( touch -> mem, 0, touch -> size );
+    return( NULL );
+}
+
+static size_t alloc_size( size_t size, bool hugepages )
+{
+    return( hugepages ? ( size + HUGE_PAGE - 1 ) & ~( HUGE_PAGE - 1 ) : size );
+}
+
+void *numa_alloc( size_t size, int node, int cpu, bool hugepages )
+{
+    size = alloc_size( size, hugepages );
+    void *mem = MAP_FAILED;
+
+    if ( hugepages )
+    {
+        mem = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if ( mem == MAP_FAILED )
+            log( 1, "No 2M hugepages reserved? Asking for transparent ones instead\n" );
+    }
+
+    if ( mem == MAP_FAILED )
+    {
+        mem = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( mem == MAP_FAILED )
+            return( NULL );
+        if ( hugepages )
+            madvise( mem, size, MADV_HUGEPAGE );
+    }
+
+    if ( node >= 0 )
+    {
+        unsigned long mask[ MAX_NODES / ( 8 * sizeof( unsigned long ) ) ];
+        memset( mask, 0, sizeof( mask ) );
+        mask[ node / ( 8 * sizeof( unsigned long ) ) ] |= 1UL << ( node % ( 8 * sizeof( unsigned long ) ) );
+        if ( syscall( SYS_mbind, mem, size, MPOL_PREFERRED_MODE, mask, MAX_NODES, 0 ) != 0 )
+            log( 2, "mbind to node %d refused, relying on first touch\n", node );
+    }
+
+    // Fault it all in now from the right node, rather than from
+    // whichever thread happens to get to it first.
+    touch_s touch;
+    touch.mem = mem;
+    touch.size = size;
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init( &attr );
+    if ( cpu >= 0 )
+        numa_pin( &attr, cpu );
+    if ( pthread_create( &tid, &attr, first_touch, &touch ) == 0 )
+        pthread_join( tid, NULL );
+    else
+        first_touch( &touch );
+    pthread_attr_destroy( &attr );
+
+    return( mem );
+}
+
+void numa_free( void *mem, size_t size, bool hugepages )
+{
+    if ( mem )
+        munmap( mem, alloc_size( size, hugepages ) );
+}
+
+void numa_pin( pthread_attr_t *attr, int cpu )
+{
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    pthread_attr_setaffinity_np( attr, sizeof( set ), &set );
+}
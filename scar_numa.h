@@ -0,0 +1,43 @@
+// ============================================================
+//
+// scar_numa.h
+//
+// Just enough NUMA for the scan engine: which CPUs we may run on and
+// what node each is on, memory placed on a given node, and pinning a
+// thread to a CPU. This talks to sysfs and the kernel directly so
+// that there's no libnuma to install on the scanners.
+//
+// ============================================================
+
+#ifndef SCAR_NUMA_H
+#define SCAR_NUMA_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <vector>
+
+const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+struct numa_cpu_s {
+    int cpu;   // As the kernel numbers them
+    int node;  // The NUMA node it's on
+};
+
+// The CPUs we are allowed to run on, taking the nodes in turn (a CPU
+// from node 0, one from node 1, ..., then the next from node 0) so
+// that handing them out in order spreads threads over the sockets.
+std::vector<numa_cpu_s> numa_cpus();
+
+// <size> bytes of zeroed memory on <node>, touched first by a thread
+// on <cpu> so that it lands there even if mbind isn't allowed. A node
+// of -1 means don't care. With <hugepages> it's backed by 2M pages if
+// any are reserved, else we ask for transparent ones. Free it with
+// numa_free and the same size and hugepages. NULL if there's no
+// memory.
+void *numa_alloc( size_t size, int node, int cpu, bool hugepages );
+void numa_free( void *mem, size_t size, bool hugepages );
+
+// Set up <attr> so that a thread created with it runs only on <cpu>.
+void numa_pin( pthread_attr_t *attr, int cpu );
+
+#endif
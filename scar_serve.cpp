@@ -0,0 +1,420 @@
+// ============================================================
+//
+// scar_serve.cpp
+//
+// "scar serve" and "scar query". The server sits on a Unix socket with
+// one ScanEngine, so images stay open and pattern
+// directories stay loaded from one request to the next. That's the
+// whole point - a lot of small searches were spending more time
+// starting up than searching.
+//
+// The protocol is one request line per connection, fields separated
+// by tabs so that paths can have spaces in them:
+//
+//     scan<TAB><device><TAB><patterndir>
+//     forget          (drop everything cached; next scan reloads)
+//     shutdown        (stop the server)
+//
+// A client gets REQUEST_SECONDS to send its request line and each
+// reply line gets SEND_SECONDS to go out; past either the connection
+// is dropped, so that one stuck client can't hold up everybody else.
+//
+// The reply to a scan is the usual one line per pattern that a plain
+// scar run prints. Every reply ends with a line that is either "done"
+// or "error <why>". Requests are handled one at a time; each scan
+// uses the -t threads the server was started with.
+//
+// Relative paths are relative to wherever the server was started, so
+// "query" turns them into absolute paths before sending them, and
+// turns the pattern names in the results back into what the user
+// gave so that the output is the same as a plain run.
+//
+// The server checks whether an image or pattern directory it already
+// has changed on disk before each scan, and reloads it if so. It only
+// keeps so much (see scar_engine.h), but "scar query --forget" drops
+// everything right away and "scar query --shutdown" stops it.
+//
+// ============================================================
+
+#include "scar.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+using namespace std;
+
+const int REQUEST_SECONDS = 10;  // To get the request line in
+const int SEND_SECONDS    = 30;  // For each write of the reply
+
+// ============================================================
+//
+// Little socket helpers.
+//
+// ============================================================
+
+static bool socket_address( const char *path, sockaddr_un &addr )
+{
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if ( strlen( path ) >= sizeof( addr.sun_path ) )
+    {
+        cerr << "The socket name " << path << " is too long.\n";
+        return( false );
+    }
+    strcpy( addr.sun_path, path );
+    return( true );
+}
+
+static bool send_all( int fd, const string &text )
+{
+    size_t sent = 0;
+    while ( sent < text.size() )
+    {
+        ssize_t count = write( fd, text.data() + sent, text.size() - sent );
+        if ( count < 0 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+            return( false );
+        sent += count;
+    }
+    return( true );
+}
+
+// Is there something at <path> we may take over? Nothing at all is
+// fine, and so is a socket nobody answers on (left over from a server
+// that didn't get to clean up). Anything else - a live server, or
+// something that isn't a socket at all - we leave alone.
+static bool socket_free( const char *path, const sockaddr_un &addr )
+{
+    struct stat info;
+    if ( lstat( path, &info ) != 0 )
+    {
+        if ( errno == ENOENT )
+            return( true );
+        perror( path );
+        return( false );
+    }
+
+    if ( ! S_ISSOCK( info.st_mode ) )
+    {
+        cerr << path << " is already there and isn't a socket. Not touching it.\n";
+        return( false );
+    }
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 )
+    {
+        perror( "socket" );
+        return( false );
+    }
+    bool answered = connect( fd, (const sockaddr *) &addr, sizeof( addr ) ) == 0;
+    close( fd );
+    if ( answered )
+    {
+        cerr << "Something is already serving on " << path << ".\n";
+        return( false );
+    }
+
+    log( 1, "Removing stale socket %s\n", path );
+    if ( unlink( path ) != 0 )
+    {
+        perror( path );
+        return( false );
+    }
+    return( true );
+}
+
+// One line, without the newline. Whatever was read past the end of
+// it is kept in <pending> for next time. A <limit> of 0 means no
+// limit; the server uses one so that nobody can make it buffer
+// forever.
+static bool read_line( int fd, string &line, string &pending, size_t limit = 0 )
+{
+    char buffer[ 4096 ];
+    size_t newline;
+
+    while ( ( newline = pending.find( '\n' ) ) == string::npos )
+    {
+        if ( limit && pending.size() > limit )
+            return( false );
+        ssize_t count = read( fd, buffer, sizeof( buffer ) );
+        if ( count < 0 && errno == EINTR )
+            continue;
+        // An error (including timing out) means no line at all.
+        if ( count < 0 )
+            return( false );
+        if ( count == 0 )
+        {
+            // Last line without a newline still counts.
+            line = pending;
+            pending.clear();
+            return( ! line.empty() );
+        }
+        pending.append( buffer, count );
+    }
+
+    line = pending.substr( 0, newline );
+    pending.erase( 0, newline + 1 );
+    return( true );
+}
+
+// Result callback for the engine - context points at the client fd.
+static void send_result( const scar_result &result, void *context )
+{
+    ostringstream out;
+    print_result( out, result );
+    // If the client went away (or stopped reading) the scan still
+    // finishes; it just has nobody to talk to. Shutting the socket down
+    // makes the rest of the writes fail right away instead of each
+    // waiting out SEND_SECONDS.
+    int fd = *(int *) context;
+    if ( ! send_all( fd, out.str() ) )
+        shutdown( fd, SHUT_RDWR );
+}
+
+// ============================================================
+//
+// handle_request
+//
+// Do whatever the one line asks. Returns false when it's time for the
+// server to stop.
+//
+// ============================================================
+
+static bool handle_request( ScanEngine &engine, int fd, const string &request )
+{
+    vector<string> field;
+    size_t start = 0;
+    for( ;; )
+    {
+        size_t tab = request.find( '\t', start );
+        field.push_back( request.substr( start, tab == string::npos ? string::npos : tab - start ) );
+        if ( tab == string::npos )
+            break;
+        start = tab + 1;
+    }
+
+    log( 1, "Request: %s\n", field[ 0 ].c_str() );
+
+    if ( field[ 0 ] == "scan" && field.size() == 3 )
+    {
+        int image = engine.attach_image( field[ 1 ].c_str() );
+        if ( image < 0 )
+        {
+            send_all( fd, "error can not use device " + field[ 1 ] + "\n" );
+            return( true );
+        }
+        int pattern_set = engine.load_patterns( field[ 2 ].c_str() );
+        if ( pattern_set < 0 )
+        {
+            send_all( fd, "error can not load patterns from " + field[ 2 ] + "\n" );
+            return( true );
+        }
+        if ( engine.run( image, pattern_set, send_result, &fd ) )
+            send_all( fd, "done\n" );
+        else
+        {
+            // Could have been the device going bad under us; don't
+            // keep it around.
+            engine.forget();
+            send_all( fd, "error scan of " + field[ 1 ] + " failed\n" );
+        }
+    }
+    else if ( field[ 0 ] == "forget" && field.size() == 1 )
+    {
+        engine.forget();
+        send_all( fd, "done\n" );
+    }
+    else if ( field[ 0 ] == "shutdown" && field.size() == 1 )
+    {
+        send_all( fd, "done\n" );
+        return( false );
+    }
+    else
+        send_all( fd, "error bad request\n" );
+
+    return( true );
+}
+
+// ============================================================
+//
+// serve
+//
+// If -d / -p were given, load those before we start listening so that
+// the first query doesn't pay for them either.
+//
+// ============================================================
+
+int serve( const scar_options &opt )
+{
+    sockaddr_un addr;
+    if ( ! socket_address( opt.socket, addr ) || ! socket_free( opt.socket, addr ) )
+        return( 1 );
+
+    // A client hanging up early should not take the server with it.
+    signal( SIGPIPE, SIG_IGN );
+
+    // Things are cached by name and "query" sends absolute names, so
+    // do the same here or the preload would never get used.
+    char path[ PATH_MAX ];
+    // Unlike a one off run, keep the pattern contents between requests.
+    ScanEngine engine( opt.disk_chunk, opt.file_chunk, opt.threads, opt.flags | SCAR_KEEP_PATTERNS );
+    if ( ! engine.ok() )
+        return( 2 );
+    if ( opt.device && ( ! realpath( opt.device, path ) || engine.attach_image( path ) < 0 ) )
+    {
+        perror( opt.device );
+        return( 2 );
+    }
+    if ( opt.patterns && ( ! realpath( opt.patterns, path ) || engine.load_patterns( path ) < 0 ) )
+    {
+        perror( opt.patterns );
+        return( 2 );
+    }
+
+    int listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listen_fd < 0 )
+    {
+        perror( "socket" );
+        return( 1 );
+    }
+
+    if ( bind( listen_fd, (sockaddr *) &addr, sizeof( addr ) ) < 0 ||
+         listen( listen_fd, 16 ) < 0 )
+    {
+        cerr << "Can not listen on " << opt.socket << ".\n";
+        perror( "bind" );
+        close( listen_fd );
+        return( 1 );
+    }
+
+    log( 0, "Serving on %s\n", opt.socket );
+
+    bool running = true;
+    while ( running )
+    {
+        int fd = accept( listen_fd, NULL, NULL );
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            perror( "accept" );
+            break;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = REQUEST_SECONDS;
+        timeout.tv_usec = 0;
+        setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        timeout.tv_sec = SEND_SECONDS;
+        setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+
+        string request, pending;
+        if ( ! read_line( fd, request, pending, 2 * PATH_MAX + 64 ) )
+            log( 1, "Dropping a client that didn't send a request\n" );
+        else
+            running = handle_request( engine, fd, request );
+        close( fd );
+    }
+
+    close( listen_fd );
+    unlink( opt.socket );
+    return( 0 );
+}
+
+// ============================================================
+//
+// query
+//
+// Send one request to a running server and copy what comes back to
+// stdout. For a scan the output looks just like a plain scar run.
+//
+// ============================================================
+
+int query( const scar_options &opt, ostream &out )
+{
+    sockaddr_un addr;
+    if ( ! socket_address( opt.socket, addr ) )
+        return( 1 );
+
+    // What the server will put in front of each pattern file name, and
+    // what a plain run would have.
+    string theirs, ours;
+
+    string request = opt.request;
+    if ( request == "scan" )
+    {
+        char device[ PATH_MAX ];
+        char patterns[ PATH_MAX ];
+        if ( ! realpath( opt.device, device ) )
+        {
+            perror( opt.device );
+            return( 2 );
+        }
+        if ( ! realpath( opt.patterns, patterns ) )
+        {
+            perror( opt.patterns );
+            return( 2 );
+        }
+        request = request + "\t" + device + "\t" + patterns;
+
+        theirs = patterns;
+        if ( theirs[ theirs.size() - 1 ] != '/' )
+            theirs += '/';
+        ours = opt.patterns;
+        if ( ours.empty() || ours[ ours.size() - 1 ] != '/' )
+            ours += '/';
+    }
+
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 || connect( fd, (sockaddr *) &addr, sizeof( addr ) ) < 0 )
+    {
+        cerr << "Can not connect to a server on " << opt.socket << ". Is \"scar serve\" running?\n";
+        perror( "connect" );
+        if ( fd >= 0 )
+            close( fd );
+        return( 1 );
+    }
+
+    if ( ! send_all( fd, request + "\n" ) )
+    {
+        perror( "write" );
+        close( fd );
+        return( 1 );
+    }
+
+    int status = 1;
+    string line, pending;
+    while ( read_line( fd, line, pending ) )
+    {
+        if ( line == "done" )
+        {
+            status = 0;
+            break;
+        }
+        if ( line.compare( 0, 6, "error " ) == 0 )
+        {
+            cerr << line.substr( 6 ) << endl;
+            break;
+        }
+        if ( ! theirs.empty() && line.compare( 0, theirs.size(), theirs ) == 0 )
+            line = ours + line.substr( theirs.size() );
+        out << line << endl;
+    }
+    if ( status && line != "done" && line.compare( 0, 6, "error " ) != 0 )
+        cerr << "The server hung up before it was done.\n";
+
+    close( fd );
+    return( status );
+}
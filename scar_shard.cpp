@@ -0,0 +1,456 @@
+// ============================================================
+//
+// scar_shard.cpp
+//
+// "scar merge" and "scar coordinate". One machine only has so many
+// cores and so much disk bandwidth, so a big image can be split up:
+//
+//     ./scar --shard 0/4 -d <device> -p <patterndir> > part.0
+//     ...
+//     ./scar --shard 3/4 -d <device> -p <patterndir> > part.3
+//     ./scar merge part.0 part.1 part.2 part.3
+//
+// Each --shard run searches one contiguous run of disk chunks and
+// prints the usual one line per pattern, between a "scar shard i/N"
+// line at the top and a "scar shard i/N done" line at the bottom.
+// A shard that died part way has no "done" line and won't be merged,
+// nor will a set of files where some pattern isn't in every shard.
+// Merging keeps the best score for each sector of
+// each pattern, which is what scan_disk_blocks does within one run
+// anyhow, so the merged output is the same as searching the whole
+// device in one go. Anything else in the files (log lines) is
+// ignored.
+//
+// "coordinate" does all of that for you. The shards run as local
+// processes, or over ssh with --hosts (round robin over the list) on
+// machines that have their own copy of the device and patterns at the
+// same paths. Either way the partial results come back to a temporary
+// directory here and get merged.
+//
+// ============================================================
+
+#include "scar.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// One pattern's worth of merged results.
+struct merged_s {
+    string                filename;
+    vector<unsigned char> match;
+    vector<unsigned>      from;  // How many times each shard reported it
+};
+
+// ============================================================
+//
+// merge_line
+//
+// Pick apart one "<file>: sectors = <n> score = <s> by sector = <...>"
+// line and fold it in. Returns false if it wasn't a result line at
+// all; <bad> gets set if it was, but it doesn't agree with what we
+// already have for that pattern. <which> says which entry it went to.
+//
+// ============================================================
+
+static bool merge_line( const string &line, vector<merged_s> &merged, map<string, unsigned> &index,
+                        bool &bad, unsigned &which )
+{
+    size_t sectors_at = line.rfind( ": sectors = " );
+    size_t score_at = line.rfind( " score = " );
+    size_t by_at = line.rfind( " by sector = " );
+    if ( sectors_at == string::npos || score_at == string::npos || by_at == string::npos ||
+         sectors_at > score_at || score_at > by_at )
+        return( false );
+
+    string filename = line.substr( 0, sectors_at );
+    unsigned long total = strtoul( line.c_str() + sectors_at + 12, NULL, 10 );
+    string by_sector = line.substr( by_at + 13 );
+    if ( by_sector.size() != total )
+        return( false );
+
+    map<string, unsigned>::iterator found = index.find( filename );
+    if ( found == index.end() )
+    {
+        index[ filename ] = merged.size();
+        merged.push_back( merged_s() );
+        merged.back().filename = filename;
+        merged.back().match.resize( total, 0 );
+        found = index.find( filename );
+    }
+
+    which = found -> second;
+    merged_s &entry = merged[ which ];
+    if ( entry.match.size() != total )
+    {
+        cerr << filename << " has " << total << " sectors in one file and "
+             << entry.match.size() << " in another.\n";
+        bad = true;
+        return( true );
+    }
+
+    // And the highest score wins.
+    for( unsigned int rep = 0; rep < total; rep++ )
+    {
+        unsigned char per = ( by_sector[ rep ] == '*' ) ? 10 : by_sector[ rep ] - '0';
+        if ( per > 10 )
+        {
+            bad = true;
+            return( true );
+        }
+        if ( per > entry.match[ rep ] )
+            entry.match[ rep ] = per;
+    }
+    return( true );
+}
+
+// ============================================================
+//
+// merge_files
+//
+// If any of the files say which shard they are, make sure we have
+// every shard exactly once, that each of them finished, and that each
+// of them reported every pattern exactly once. A missing one would
+// quietly give lower scores, which is the worst kind of wrong answer.
+// Files without any shard lines (plain runs) are merged as they are.
+//
+// ============================================================
+
+static bool merge_files( const vector<string> &files, ostream &out )
+{
+    vector<merged_s> merged;
+    map<string, unsigned> index;
+    vector<unsigned> seen;
+    unsigned shards = 0;
+    unsigned plain = 0;   // Files with no shard line at all
+    bool bad = false;
+
+    for( unsigned int f = 0; f < files.size(); f++ )
+    {
+        ifstream in( files[ f ].c_str() );
+        if ( ! in )
+        {
+            perror( files[ f ].c_str() );
+            return( false );
+        }
+
+        string line;
+        int current = -1;     // Which shard this file is
+        bool done = false;
+        while ( getline( in, line ) )
+        {
+            unsigned shard, of;
+            char extra[ 8 ];
+            int fields = sscanf( line.c_str(), "scar shard %u/%u %7s", &shard, &of, extra );
+            if ( fields >= 2 )
+            {
+                if ( shards == 0 )
+                {
+                    shards = of;
+                    seen.assign( shards, 0 );
+                }
+                if ( of != shards || shard >= shards )
+                {
+                    cerr << files[ f ] << " is shard " << shard << "/" << of
+                         << " but other files are out of " << shards << ".\n";
+                    return( false );
+                }
+                if ( fields == 2 && current < 0 )
+                {
+                    current = shard;
+                    seen[ shard ]++;
+                }
+                else if ( fields == 3 && strcmp( extra, "done" ) == 0 && current == (int) shard )
+                    done = true;
+                else
+                {
+                    cerr << files[ f ] << " has a stray \"" << line << "\" line.\n";
+                    bad = true;
+                }
+            }
+            else
+            {
+                unsigned which;
+                if ( merge_line( line, merged, index, bad, which ) && current >= 0 )
+                {
+                    merged[ which ].from.resize( shards, 0 );
+                    merged[ which ].from[ current ]++;
+                }
+            }
+        }
+
+        if ( current < 0 )
+            plain++;
+        else if ( ! done )
+        {
+            cerr << files[ f ] << " (shard " << current << "/" << shards
+                 << ") never finished - it has no \"done\" line.\n";
+            bad = true;
+        }
+    }
+
+    if ( shards && plain )
+    {
+        cerr << plain << " of the files aren't shards at all, and the rest are.\n";
+        bad = true;
+    }
+
+    for( unsigned int s = 0; s < shards; s++ )
+        if ( seen[ s ] != 1 )
+        {
+            cerr << "Shard " << s << "/" << shards << " shows up " << seen[ s ] << " times.\n";
+            bad = true;
+        }
+
+    for( unsigned int m = 0; m < merged.size() && shards; m++ )
+    {
+        merged[ m ].from.resize( shards, 0 );
+        for( unsigned int s = 0; s < shards; s++ )
+            if ( merged[ m ].from[ s ] != 1 && seen[ s ] == 1 )
+            {
+                cerr << merged[ m ].filename << " is in shard " << s << "/" << shards << " "
+                     << merged[ m ].from[ s ] << " times.\n";
+                bad = true;
+            }
+    }
+
+    if ( bad )
+    {
+        cerr << "Not merging - the partial results don't go together.\n";
+        return( false );
+    }
+
+    for( unsigned int m = 0; m < merged.size(); m++ )
+    {
+        scar_result result;
+        result.filename = merged[ m ].filename.c_str();
+        result.total_sectors = merged[ m ].match.size();
+        result.match = merged[ m ].match.empty() ? NULL : &merged[ m ].match[ 0 ];
+        result.score = overall_score( result.match, result.total_sectors );
+        print_result( out, result );
+    }
+    return( true );
+}
+
+int merge( const scar_options &opt, ostream &out )
+{
+    vector<string> files( opt.files.begin(), opt.files.end() );
+    return( merge_files( files, out ) ? 0 : 1 );
+}
+
+// ============================================================
+//
+// coordinate
+//
+// Start one scar --shard per worker with its stdout going to a file in
+// a temporary directory, wait for them all, then merge. If any of them
+// fail the partial results are left behind to look at.
+//
+// ============================================================
+
+// Single quotes for the remote shell, which is what ssh hands the
+// command to.
+static string shell_quote( const string &arg )
+{
+    string quoted = "'";
+    for( unsigned int c = 0; c < arg.size(); c++ )
+        if ( arg[ c ] == '\'' )
+            quoted += "'\\''";
+        else
+            quoted += arg[ c ];
+    return( quoted + "'" );
+}
+
+static string number( unsigned long long value )
+{
+    ostringstream text;
+    text << value;
+    return( text.str() );
+}
+
+int coordinate( const scar_options &opt, ostream &out )
+{
+    vector<string> hosts;
+    if ( opt.hosts )
+    {
+        stringstream list( opt.hosts );
+        string host;
+        while ( getline( list, host, ',' ) )
+            if ( ! host.empty() )
+                hosts.push_back( host );
+    }
+
+    unsigned int workers = opt.workers ? opt.workers : hosts.size();
+    if ( workers == 0 )
+    {
+        cerr << "No workers to run.\n";
+        return( 1 );
+    }
+
+    // Local workers are just us again.
+    char self[ PATH_MAX ];
+    ssize_t self_len = readlink( "/proc/self/exe", self, sizeof( self ) - 1 );
+    if ( self_len <= 0 )
+    {
+        perror( "/proc/self/exe" );
+        return( 1 );
+    }
+    self[ self_len ] = '\0';
+
+    char dir[] = "/tmp/scar.XXXXXX";
+    if ( ! mkdtemp( dir ) )
+    {
+        perror( "mkdtemp" );
+        return( 1 );
+    }
+
+    vector<string> partial( workers );
+    vector<pid_t> pid( workers, -1 );
+    unsigned int running = 0;
+    bool ok = true;
+
+    for( unsigned int i = 0; i < workers; i++ )
+    {
+        partial[ i ] = string( dir ) + "/shard." + number( i );
+
+        vector<string> args;
+        args.push_back( hosts.empty() ? string( self ) : string( opt.remote ) );
+        args.push_back( "--shard" );
+        args.push_back( number( i ) + "/" + number( workers ) );
+        args.push_back( "-d" );
+        args.push_back( opt.device );
+        args.push_back( "-p" );
+        args.push_back( opt.patterns );
+        args.push_back( "-t" );
+        args.push_back( number( opt.threads ) );
+        args.push_back( "-c" );
+        args.push_back( number( opt.disk_chunk ) );
+        args.push_back( "-f" );
+        args.push_back( number( opt.file_chunk ) );
+        if ( opt.flags & SCAR_NUMA )
+        {
+            // Shards on the same machine get CPUs of their own: worker
+            // i is the (i / hosts)'th one on its host, or the i'th one
+            // here.
+            unsigned int on_host = hosts.empty() ? i : i / hosts.size();
+            args.push_back( "--numa" );
+            args.push_back( "--cpu-offset" );
+            args.push_back( number( on_host * opt.threads ) );
+        }
+        if ( opt.flags & SCAR_HUGEPAGES )
+            args.push_back( "--hugepages" );
+        for( unsigned int l = 0; l < log_level; l++ )
+            args.push_back( "-l" );
+
+        if ( ! hosts.empty() )
+        {
+            string command;
+            for( unsigned int a = 0; a < args.size(); a++ )
+                command += ( a ? " " : "" ) + shell_quote( args[ a ] );
+            args.clear();
+            args.push_back( "ssh" );
+            args.push_back( "-n" );
+            args.push_back( "-o" );
+            args.push_back( "BatchMode=yes" );
+            args.push_back( hosts[ i % hosts.size() ] );
+            args.push_back( command );
+        }
+
+        int fd = open( partial[ i ].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd < 0 )
+        {
+            perror( partial[ i ].c_str() );
+            ok = false;
+            break;
+        }
+
+        vector<char *> argv;
+        for( unsigned int a = 0; a < args.size(); a++ )
+            argv.push_back( (char *) args[ a ].c_str() );
+        argv.push_back( NULL );
+
+        cout << std::flush;
+        pid[ i ] = fork();
+        if ( pid[ i ] == 0 )
+        {
+            // None of the workers read anything, and N ssh clients all
+            // reading our stdin would eat whatever a calling script
+            // meant for the next command.
+            int null_fd = open( "/dev/null", O_RDONLY );
+            if ( null_fd >= 0 )
+            {
+                dup2( null_fd, 0 );
+                close( null_fd );
+            }
+            dup2( fd, 1 );
+            close( fd );
+            execvp( argv[ 0 ], &argv[ 0 ] );
+            perror( argv[ 0 ] );
+            _exit( 127 );
+        }
+        close( fd );
+        if ( pid[ i ] < 0 )
+        {
+            perror( "fork" );
+            ok = false;
+            break;
+        }
+
+        running++;
+        log( 1, "Shard %u/%u started on %s\n", i, workers,
+             hosts.empty() ? "this machine" : hosts[ i % hosts.size() ].c_str() );
+    }
+
+    // Wait for everyone we did start, even if we're going to give up.
+    while ( running > 0 )
+    {
+        int status;
+        pid_t done = wait( &status );
+        if ( done < 0 )
+        {
+            perror( "wait" );
+            return( 1 );
+        }
+        for( unsigned int i = 0; i < workers; i++ )
+            if ( pid[ i ] == done )
+            {
+                running--;
+                if ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 )
+                    log( 1, "Shard %u/%u finished\n", i, workers );
+                else
+                {
+                    cerr << "Shard " << i << "/" << workers << " failed";
+                    if ( ! hosts.empty() )
+                        cerr << " on " << hosts[ i % hosts.size() ];
+                    cerr << ".\n";
+                    ok = false;
+                }
+            }
+    }
+
+    if ( ok )
+        ok = merge_files( partial, out );
+
+    if ( ! ok )
+    {
+        cerr << "The partial results are in " << dir << ".\n";
+        return( 1 );
+    }
+
+    for( unsigned int i = 0; i < workers; i++ )
+        unlink( partial[ i ].c_str() );
+    rmdir( dir );
+    return( 0 );
+}
@@ -0,0 +1,712 @@
+// ============================================================
+//
+// scar_tune.cpp
+//
+// --tune. How long a run takes comes down to a few things:
+//
+//   -- The compares. Every sector of every pattern gets compared with
+//      every sector of the disk, so the total is the same whatever the
+//      settings. The rate isn't: it depends on the number of threads
+//      and on whether a disk chunk still fits in cache.
+//   -- The threads work in lockstep, one disk chunk at a time, so each
+//      chunk takes as long as the slot with the most pattern sectors
+//      loaded. Each slot needs one full pass over the disk for every
+//      <file_chunk> of its pattern.
+//   -- The read of the next chunk overlaps the compares (double
+//      buffering), so a chunk costs whichever of the two is slower.
+//      After the first pass the image may be in the page cache.
+//   -- Starting and joining the threads once per chunk.
+//
+// So we measure each of those on this machine with this image and
+// these patterns, then play the run forward for every safe
+// combination and keep the fastest. All of the probes together take a
+// few seconds.
+//
+// ============================================================
+
+#include "scar_tune.h"
+#include "scar_engine.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+const off64_t MIN_DISK_CHUNK     = 65536;       // Smaller and the per chunk overhead wins
+const off64_t MAX_DISK_CHUNK     = 1073741824;  // Biggest -c anyone has used
+const off64_t MIN_FILE_CHUNK     = 65536;       // Keeps the play forward quick
+const off64_t MAX_PROBE_READ     = 67108864;    // No need to read more than this to see a rate
+const double  PROBE_SECONDS      = 0.05;        // Per compare / read probe
+const unsigned int MAX_PROBE_READS = 8;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+// ============================================================
+//
+// disk_chunks
+//
+// The -c settings worth trying: multiples of SEC_SIZE that divide the
+// image exactly (anything else is refused at attach time), keeping the
+// biggest one between each power of two.
+//
+// ============================================================
+
+static vector<off64_t> disk_chunks( off64_t size, off64_t most )
+{
+    vector<off64_t> result;
+
+    if ( size <= MIN_DISK_CHUNK )
+    {
+        // The engine will just use the whole image as one chunk.
+        result.push_back( size );
+        return( result );
+    }
+    if ( size % SEC_SIZE )
+        return( result );
+
+    map<int, off64_t> best;
+    off64_t sectors = size / SEC_SIZE;
+    for( off64_t d = 1; d * d <= sectors; d++ )
+        if ( sectors % d == 0 )
+        {
+            off64_t both[ 2 ] = { d * SEC_SIZE, ( sectors / d ) * SEC_SIZE };
+            for( unsigned int b = 0; b < 2; b++ )
+                if ( both[ b ] >= MIN_DISK_CHUNK && both[ b ] <= most )
+                {
+                    int bucket = 63 - __builtin_clzll( both[ b ] );
+                    if ( both[ b ] > best[ bucket ] )
+                        best[ bucket ] = both[ b ];
+                }
+        }
+
+    for( map<int, off64_t>::iterator i = best.begin(); i != best.end(); i++ )
+        result.push_back( i -> second );
+    return( result );
+}
+
+// ============================================================
+//
+// read_rate
+//
+// Bytes per second reading the image <chunk> bytes at a time (up to
+// MAX_PROBE_READ per read). If <cold> we first ask the kernel to drop
+// that part of the image from the page cache.
+//
+// ============================================================
+
+static double read_rate( int fd, off64_t size, off64_t chunk, bool cold, unsigned char *buffer )
+{
+    off64_t each = chunk < MAX_PROBE_READ ? chunk : MAX_PROBE_READ;
+    unsigned int reads = size / each < MAX_PROBE_READS ? size / each : MAX_PROBE_READS;
+    if ( reads == 0 )
+        reads = 1;
+
+    if ( cold )
+        posix_fadvise( fd, 0, each * reads, POSIX_FADV_DONTNEED );
+
+    off64_t total = 0;
+    double started = now();
+    for( unsigned int r = 0; r < reads; r++ )
+    {
+        ssize_t count = pread64( fd, buffer, each, r * each );
+        if ( count <= 0 )
+            break;
+        total += count;
+        if ( now() - started > PROBE_SECONDS * 4 )
+            break;
+    }
+    double took = now() - started;
+    return( took > 0 ? total / took : 0 );
+}
+
+// ============================================================
+//
+// compare_rate
+//
+// Sector compares per second with <threads> threads all working on
+// the same <disk_size> bytes of disk, which is what the engine does.
+// The threads run the engine's own scan_disk_blocks.
+//
+// ============================================================
+
+struct probe_s {
+    const unsigned char *disk;
+    off64_t             disk_size;
+    const unsigned char *pattern;
+    unsigned int        pattern_sectors;
+    unsigned long long  compares;
+};
+
+static void *compare_probe( void *param )
+{
+    probe_s *probe = (probe_s *) param;
+
+    probe -> compares = count_compares( probe -> disk, probe -> disk_size,
+                                        probe -> pattern, probe -> pattern_sectors, PROBE_SECONDS );
+    return( NULL );
+}
+
+static double compare_rate( const unsigned char *disk, off64_t disk_size,
+                            const unsigned char *pattern, unsigned int pattern_sectors, unsigned int threads )
+{
+    vector<probe_s> probe( threads );
+    vector<pthread_t> tid( threads );
+    double started = now();
+
+    for( unsigned int i = 0; i < threads; i++ )
+    {
+        probe[ i ].disk = disk;
+        probe[ i ].disk_size = disk_size;
+        probe[ i ].pattern = pattern;
+        probe[ i ].pattern_sectors = pattern_sectors;
+        probe[ i ].compares = 0;
+        pthread_create( &tid[ i ], NULL, compare_probe, &probe[ i ] );
+    }
+
+    unsigned long long compares = 0;
+    for( unsigned int i = 0; i < threads; i++ )
+    {
+        pthread_join( tid[ i ], NULL );
+        compares += probe[ i ].compares;
+    }
+    return( compares / ( now() - started ) );
+}
+
+// Seconds to start and join <threads> threads that do nothing - the
+// engine pays this once per disk chunk.
+static void *do_nothing( void * )
+{
+    return( NULL );
+}
+
+static double thread_overhead( unsigned int threads )
+{
+    const unsigned int tries = 20;
+    vector<pthread_t> tid( threads );
+    double started = now();
+
+    for( unsigned int t = 0; t < tries; t++ )
+    {
+        for( unsigned int i = 0; i < threads; i++ )
+            pthread_create( &tid[ i ], NULL, do_nothing, NULL );
+        for( unsigned int i = 0; i < threads; i++ )
+            pthread_join( tid[ i ], NULL );
+    }
+    return( ( now() - started ) / tries );
+}
+
+// ============================================================
+//
+// report_caches
+//
+// Just so the numbers below make sense - a disk chunk that fits in L2
+// or L3 compares a lot faster than one that doesn't.
+//
+// ============================================================
+
+static void report_caches()
+{
+    cerr << "Caches:";
+    for( unsigned int index = 0; ; index++ )
+    {
+        char filename[ 128 ];
+        string level, type, size;
+
+        snprintf( filename, sizeof( filename ), "/sys/devices/system/cpu/cpu0/cache/index%u/level", index );
+        ifstream level_in( filename );
+        if ( ! ( level_in >> level ) )
+            break;
+        snprintf( filename, sizeof( filename ), "/sys/devices/system/cpu/cpu0/cache/index%u/type", index );
+        ifstream type_in( filename );
+        type_in >> type;
+        snprintf( filename, sizeof( filename ), "/sys/devices/system/cpu/cpu0/cache/index%u/size", index );
+        ifstream size_in( filename );
+        size_in >> size;
+
+        if ( type != "Instruction" )
+            cerr << " L" << level << ( type == "Data" ? "d" : "" ) << " " << size;
+        if ( index > 16 )
+            break;
+    }
+    cerr << endl;
+}
+
+// ============================================================
+//
+// play_forward
+//
+// Predicted seconds for the whole run. Slots take patterns in
+// directory order, as the engine does. Each round is one full pass
+// over the disk (or over the biggest of <shards> pieces of it, as
+// ScanEngine::run cuts them), and every slot loads at most
+// <file_chunk> of its pattern for that round.
+//
+// ============================================================
+
+struct rates_s {
+    double compare;   // Compares per second, all threads together
+    double cold_read; // Bytes per second from the device
+    double warm_read; // Bytes per second from the page cache
+    double overhead;  // Seconds per disk chunk to start / join the threads
+};
+
+static double play_forward( const vector<unsigned int> &pattern_sectors, off64_t size, bool cached,
+                            const scar_tuning &tuning, const rates_s &rates, unsigned int shards )
+{
+    off64_t chunk = size < tuning.disk_chunk ? size : tuning.disk_chunk;
+    off64_t loops = ( size / chunk + shards - 1 ) / shards;
+    double per_compare = tuning.threads / rates.compare;
+    unsigned int file_sectors = tuning.file_chunk / SEC_SIZE;
+
+    vector<unsigned int> left( tuning.threads, 0 );
+    size_t next_pattern = 0;
+    double total = 0;
+    bool first_pass = true;
+
+    for( ;; )
+    {
+        unsigned int widest = 0;
+        for( unsigned int s = 0; s < tuning.threads; s++ )
+        {
+            while ( left[ s ] == 0 && next_pattern < pattern_sectors.size() )
+                left[ s ] = pattern_sectors[ next_pattern++ ];
+            unsigned int loaded = left[ s ] < file_sectors ? left[ s ] : file_sectors;
+            left[ s ] -= loaded;
+            if ( loaded > widest )
+                widest = loaded;
+        }
+        if ( widest == 0 )
+            break;
+
+        double compute = widest * ( chunk / SEC_SIZE ) * per_compare;
+        double read = chunk / ( ( first_pass || ! cached ) ? rates.cold_read : rates.warm_read );
+        total += loops * ( ( compute > read ? compute : read ) + rates.overhead );
+        first_pass = false;
+    }
+    return( total );
+}
+
+// ============================================================
+//
+// tune
+//
+// ============================================================
+
+bool tune( const char *device, const char *directory, scar_tuning &tuning, unsigned int fixed,
+           unsigned int shards )
+{
+    // ============================================================
+    // What are we up against? The image size, and the size of each
+    // pattern (plus a little of one of them to compare with).
+    // ============================================================
+
+    int fd = open( device, O_RDONLY );
+    if ( fd < 0 )
+    {
+        cerr << "Error opening the device " << device << ".\n";
+        perror( "open" );
+        return( false );
+    }
+    off64_t size = lseek64( fd, 0, SEEK_END );
+    if ( size <= 0 )
+    {
+        cerr << "The device " << device << " seems to be empty.\n";
+        close( fd );
+        return( false );
+    }
+
+    // A given -c has to work with this image, and there's no point
+    // timing anything if it doesn't.
+    if ( ( fixed & TUNE_DISK_CHUNK ) && size > tuning.disk_chunk && size % tuning.disk_chunk != 0 )
+    {
+        cerr << "The actual image size in bytes (" << size << ") is not divisible by -c "
+             << tuning.disk_chunk << ".\n";
+        vector<off64_t> chunks = disk_chunks( size, MAX_DISK_CHUNK );
+        if ( ! chunks.empty() )
+        {
+            cerr << "Sizes that would work include";
+            for( unsigned int c = 0; c < chunks.size(); c++ )
+                cerr << " " << chunks[ c ];
+            cerr << ".\n";
+        }
+        close( fd );
+        return( false );
+    }
+
+    DIR *dir = opendir( directory );
+    if ( ! dir )
+    {
+        cerr << "Error opening the directory " << directory << ".\n";
+        perror( "opendir" );
+        close( fd );
+        return( false );
+    }
+
+    vector<unsigned int> pattern_sectors;
+    vector<unsigned char> sample;
+    unsigned long long all_sectors = 0;
+    off64_t biggest = 0;
+    struct dirent *nextfile;
+    while ( ( nextfile = readdir( dir ) ) )
+    {
+        if ( nextfile -> d_name[ 0 ] == '.' )
+            continue;
+        string filename = string( directory ) + "/" + nextfile -> d_name;
+        struct stat info;
+        if ( stat( filename.c_str(), &info ) != 0 || ! S_ISREG( info.st_mode ) )
+            continue;
+        pattern_sectors.push_back( info.st_size / SEC_SIZE );
+        all_sectors += info.st_size / SEC_SIZE;
+        if ( info.st_size > biggest )
+            biggest = info.st_size;
+
+        if ( sample.empty() && info.st_size >= (off64_t) SEC_SIZE )
+        {
+            int pattern_fd = open( filename.c_str(), O_RDONLY );
+            if ( pattern_fd >= 0 )
+            {
+                sample.resize( MIN_FILE_CHUNK );
+                ssize_t count = read( pattern_fd, &sample[ 0 ], sample.size() );
+                sample.resize( count > 0 ? ( count / SEC_SIZE ) * SEC_SIZE : 0 );
+                close( pattern_fd );
+            }
+        }
+    }
+    closedir( dir );
+
+    // Nothing to go on? Make something up for the compare probe.
+    if ( sample.empty() )
+    {
+        sample.resize( SEC_SIZE );
+        for( unsigned int i = 0; i < sample.size(); i++ )
+            sample[ i ] = rand();
+    }
+
+    cerr << "Tuning for " << device << " (" << size << " bytes) and "
+         << pattern_sectors.size() << " patterns (" << all_sectors << " sectors)";
+    if ( shards > 1 )
+        cerr << " as " << shards << " shards";
+    cerr << endl;
+    report_caches();
+
+    // ============================================================
+    // The candidates. Leave room for the two disk buffers in a
+    // quarter of memory; if the whole image fits in half of it, it'll
+    // likely stay in the page cache after the first pass.
+    // ============================================================
+
+    off64_t memory = (off64_t) sysconf( _SC_PHYS_PAGES ) * sysconf( _SC_PAGESIZE );
+    bool cached = size <= memory / 2;
+    off64_t most = memory / 8 < MAX_DISK_CHUNK ? memory / 8 : MAX_DISK_CHUNK;
+
+    vector<off64_t> chunks;
+    if ( fixed & TUNE_DISK_CHUNK )
+        chunks.push_back( tuning.disk_chunk );
+    else
+        chunks = disk_chunks( size, most );
+    if ( chunks.empty() )
+    {
+        cerr << "The image size " << size << " has no divisor that is a multiple of "
+             << SEC_SIZE << " - can't pick a disk chunk size.\n";
+        close( fd );
+        return( false );
+    }
+
+    cpu_set_t allowed;
+    unsigned int cpus = 1;
+    if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0 )
+        cpus = CPU_COUNT( &allowed );
+    // Each shard gets its share of them.
+    unsigned int all_cpus = cpus;
+    cpus = cpus / shards > 0 ? cpus / shards : 1;
+
+    // More threads than patterns just leaves slots empty.
+    unsigned int useful = pattern_sectors.size() > 0 ? pattern_sectors.size() : 1;
+    vector<unsigned int> thread_counts;
+    if ( fixed & TUNE_THREADS )
+        thread_counts.push_back( tuning.threads );
+    else
+    {
+        for( unsigned int t = 1; t < cpus && t < useful; t *= 2 )
+            thread_counts.push_back( t );
+        thread_counts.push_back( cpus < useful ? cpus : useful );
+    }
+
+    // ============================================================
+    // Reads: cold and warm for each disk chunk size.
+    // ============================================================
+
+    off64_t sample_size = size < MAX_PROBE_READ ? size : MAX_PROBE_READ;
+    vector<unsigned char> disk( sample_size );
+    map<off64_t, rates_s> by_chunk;
+
+    for( unsigned int c = 0; c < chunks.size(); c++ )
+    {
+        rates_s &rates = by_chunk[ chunks[ c ] ];
+        rates.cold_read = read_rate( fd, size, chunks[ c ], true, &disk[ 0 ] );
+        rates.warm_read = read_rate( fd, size, chunks[ c ], false, &disk[ 0 ] );
+        if ( rates.cold_read <= 0 || rates.warm_read <= 0 )
+        {
+            cerr << "Could not read " << device << " to time it.\n";
+            close( fd );
+            return( false );
+        }
+        cerr << "Reads with -c " << chunks[ c ] << ": " << rates.cold_read / 1e6 << " MB/s cold, "
+             << rates.warm_read / 1e6 << " MB/s cached" << endl;
+    }
+
+    // What the compare probes will look at - the start of the image.
+    if ( pread64( fd, &disk[ 0 ], sample_size, 0 ) != sample_size )
+    {
+        cerr << "Could not read " << device << " to time it.\n";
+        close( fd );
+        return( false );
+    }
+    close( fd );
+
+    // ============================================================
+    // Compares for each disk chunk size and thread count. Past
+    // MAX_PROBE_READ it's all out of cache anyhow, so the rate there
+    // stands in for the bigger chunks too.
+    // ============================================================
+
+    map< pair<off64_t, unsigned int>, double > compares;
+    map<unsigned int, double> overhead;
+    for( unsigned int t = 0; t < thread_counts.size(); t++ )
+    {
+        unsigned int threads = thread_counts[ t ];
+        overhead[ threads ] = thread_overhead( threads );
+        cerr << "Compares with -t " << threads << ":";
+        for( unsigned int c = 0; c < chunks.size(); c++ )
+        {
+            off64_t probe_size = chunks[ c ] < sample_size ? chunks[ c ] : sample_size;
+            double rate = compare_rate( &disk[ 0 ], probe_size, &sample[ 0 ], sample.size() / SEC_SIZE, threads );
+            compares[ make_pair( chunks[ c ], threads ) ] = rate;
+            cerr << " " << chunks[ c ] << ":" << rate / 1e6 << "M/s";
+        }
+        cerr << " (threads cost " << overhead[ threads ] * 1e6 << "us per chunk)" << endl;
+    }
+
+    // ============================================================
+    // Play forward every safe combination. <file_chunk> can't be
+    // bigger than <disk_chunk>, and there's no point in it being
+    // bigger than the biggest pattern.
+    // ============================================================
+
+    off64_t biggest_rounded = ( ( biggest + SEC_SIZE - 1 ) / SEC_SIZE ) * SEC_SIZE;
+    scar_tuning best = tuning;
+    double best_time = -1;
+
+    for( unsigned int c = 0; c < chunks.size(); c++ )
+    {
+        vector<off64_t> file_chunks;
+        if ( fixed & TUNE_FILE_CHUNK )
+            file_chunks.push_back( tuning.file_chunk );
+        else
+        {
+            for( off64_t f = MIN_FILE_CHUNK; f <= chunks[ c ] && f < biggest_rounded; f *= 2 )
+                file_chunks.push_back( f );
+            off64_t top = biggest_rounded < chunks[ c ] ? biggest_rounded : chunks[ c ];
+            if ( top < MIN_FILE_CHUNK )
+                top = ( chunks[ c ] < MIN_FILE_CHUNK ) ? ( chunks[ c ] / SEC_SIZE ) * SEC_SIZE : MIN_FILE_CHUNK;
+            file_chunks.push_back( top );
+        }
+
+        for( unsigned int f = 0; f < file_chunks.size(); f++ )
+        {
+            if ( file_chunks[ f ] > chunks[ c ] || file_chunks[ f ] < (off64_t) SEC_SIZE )
+                continue;
+            for( unsigned int t = 0; t < thread_counts.size(); t++ )
+            {
+                scar_tuning trying;
+                trying.threads = thread_counts[ t ];
+                trying.disk_chunk = chunks[ c ];
+                trying.file_chunk = file_chunks[ f ];
+
+                // The shards all read at once, so each gets its share
+                // of the device.
+                rates_s rates = by_chunk[ chunks[ c ] ];
+                rates.cold_read /= shards;
+                rates.warm_read /= shards;
+                rates.compare = compares[ make_pair( chunks[ c ], trying.threads ) ];
+                // And more shards than CPUs means they take turns.
+                if ( shards * trying.threads > all_cpus )
+                    rates.compare *= (double) all_cpus / ( shards * trying.threads );
+                rates.overhead = overhead[ trying.threads ];
+
+                double predicted = play_forward( pattern_sectors, size, cached, trying, rates, shards );
+                log( 1, "-t %u -c %llu -f %llu: %.2f s\n", trying.threads,
+                     (unsigned long long) trying.disk_chunk, (unsigned long long) trying.file_chunk, predicted );
+                if ( best_time < 0 || predicted < best_time )
+                {
+                    best = trying;
+                    best_time = predicted;
+                }
+            }
+        }
+    }
+
+    if ( best_time < 0 )
+    {
+        cerr << "No safe combination of -t, -c and -f to pick from - the file chunk must not"
+             << " be bigger than the disk chunk.\n";
+        return( false );
+    }
+
+    tuning = best;
+    cerr << "Picked -t " << tuning.threads << " -c " << tuning.disk_chunk << " -f " << tuning.file_chunk
+         << " (about " << best_time << " s)" << endl;
+    return( true );
+}
+
+// ============================================================
+//
+// save_profile / load_profile
+//
+// A few "name value" lines. Anything else is ignored on the way in.
+//
+// ============================================================
+
+static string host_name()
+{
+    char name[ 256 ];
+    if ( gethostname( name, sizeof( name ) ) != 0 )
+        return( "unknown" );
+    name[ sizeof( name ) - 1 ] = '\0';
+    return( name );
+}
+
+bool save_profile( const char *filename, const scar_tuning &tuning )
+{
+    ofstream out( filename );
+    if ( ! out )
+    {
+        perror( filename );
+        return( false );
+    }
+    out << "# scar --tune profile" << endl
+        << "host " << host_name() << endl
+        << "threads " << tuning.threads << endl
+        << "disk_chunk " << tuning.disk_chunk << endl
+        << "file_chunk " << tuning.file_chunk << endl;
+    return( true );
+}
+
+bool load_profile( const char *filename, const char *device, scar_tuning &tuning, unsigned int fixed )
+{
+    ifstream in( filename );
+    if ( ! in )
+    {
+        perror( filename );
+        return( false );
+    }
+
+    // Every number has to be there and make sense - a hand edited or
+    // truncated profile shouldn't get anywhere near the engine.
+    scar_tuning loaded = tuning;
+    string name, host, value;
+    long long threads = -1, disk_chunk = -1, file_chunk = -1;
+    while ( in >> name )
+    {
+        long long *number = NULL;
+        if ( name == "host" )
+            in >> host;
+        else if ( name == "threads" )
+            number = &threads;
+        else if ( name == "disk_chunk" )
+            number = &disk_chunk;
+        else if ( name == "file_chunk" )
+            number = &file_chunk;
+
+        if ( number )
+        {
+            char *end;
+            in >> value;
+            *number = strtoll( value.c_str(), &end, 10 );
+            if ( value.empty() || *end != '\0' )
+            {
+                cerr << "The profile " << filename << " has \"" << value << "\" for " << name
+                     << ", which isn't a number.\n";
+                return( false );
+            }
+        }
+        // Comments and anything we don't know about
+        getline( in, name );
+    }
+
+    if ( threads <= 0 || (unsigned int) threads != threads ||
+         disk_chunk <= 0 || disk_chunk % SEC_SIZE ||
+         file_chunk <= 0 || file_chunk % SEC_SIZE || file_chunk > disk_chunk )
+    {
+        cerr << "The profile " << filename << " doesn't have a usable threads (" << threads
+             << "), disk_chunk (" << disk_chunk << ") and file_chunk (" << file_chunk << ").\n"
+             << "The chunks must be multiples of " << SEC_SIZE << " with file_chunk no bigger than"
+             << " disk_chunk. Run --tune again.\n";
+        return( false );
+    }
+    loaded.threads = threads;
+    loaded.disk_chunk = disk_chunk;
+    loaded.file_chunk = file_chunk;
+
+    if ( host != host_name() )
+    {
+        cerr << "The profile " << filename << " was made on " << ( host.empty() ? "?" : host )
+             << ", not here. Run --tune again on this host.\n";
+        return( false );
+    }
+
+    // Tuned on some other image? If we can't open this one (it may
+    // only be on the coordinate hosts) the engine gets to complain.
+    off64_t size = -1;
+    int fd = open( device, O_RDONLY );
+    if ( fd >= 0 )
+    {
+        size = lseek64( fd, 0, SEEK_END );
+        close( fd );
+    }
+
+    if ( ! ( fixed & TUNE_DISK_CHUNK ) && size > loaded.disk_chunk && size % loaded.disk_chunk != 0 )
+    {
+        // The closest one that divides it, by ratio.
+        vector<off64_t> chunks = disk_chunks( size, MAX_DISK_CHUNK );
+        if ( chunks.empty() )
+        {
+            cerr << "The image size " << size << " has no divisor that is a multiple of "
+                 << SEC_SIZE << " - can't pick a disk chunk size.\n";
+            return( false );
+        }
+        off64_t nearest = chunks[ 0 ];
+        for( unsigned int c = 1; c < chunks.size(); c++ )
+        {
+            double was = (double) nearest / loaded.disk_chunk;
+            double is = (double) chunks[ c ] / loaded.disk_chunk;
+            if ( ( is < 1 ? 1 / is : is ) < ( was < 1 ? 1 / was : was ) )
+                nearest = chunks[ c ];
+        }
+        cerr << "The profile's -c " << loaded.disk_chunk << " doesn't divide " << device
+             << " (" << size << " bytes), using -c " << nearest << " instead.\n";
+        loaded.disk_chunk = nearest;
+        if ( ! ( fixed & TUNE_FILE_CHUNK ) && loaded.file_chunk > nearest )
+            loaded.file_chunk = nearest;
+    }
+
+    tuning = loaded;
+    return( true );
+}
@@ -0,0 +1,44 @@
+// ============================================================
+//
+// scar_tune.h
+//
+// Picking -t, -c and -f for the scan engine by measuring instead of
+// guessing. See scar_tune.cpp for how.
+//
+// ============================================================
+
+#ifndef SCAR_TUNE_H
+#define SCAR_TUNE_H
+
+#include <sys/types.h>
+
+struct scar_tuning {
+    unsigned int threads;     // -t
+    off64_t      disk_chunk;  // -c
+    off64_t      file_chunk;  // -f
+};
+
+// Bits for <fixed> - the settings tune() must leave alone.
+const unsigned int TUNE_THREADS    = 1;
+const unsigned int TUNE_DISK_CHUNK = 2;
+const unsigned int TUNE_FILE_CHUNK = 4;
+
+// Time some short probes against this device and pattern directory,
+// then fill in the fastest safe settings. What it found goes to cerr.
+// Returns false (after saying why) if there is no safe setting at all.
+// With <shards> > 1 the settings are for each of that many --shard
+// runs sharing this machine ("scar coordinate -n"): they split the
+// CPUs and the device between them, and each only has its piece of
+// the image to get through.
+bool tune( const char *device, const char *directory, scar_tuning &tuning, unsigned int fixed,
+           unsigned int shards = 1 );
+
+// A profile is the tuning plus the host it was made on. Loading one
+// made on some other host is refused, since the numbers won't apply.
+// On the same host it can be used for other images too: if the saved
+// -c doesn't divide <device> (and isn't in <fixed>) the nearest size
+// that does is used instead, with -f brought down to fit if need be.
+bool save_profile( const char *filename, const scar_tuning &tuning );
+bool load_profile( const char *filename, const char *device, scar_tuning &tuning, unsigned int fixed );
+
+#endif